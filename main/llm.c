@@ -7,6 +7,10 @@
  */
 
 #include "llm.h"
+#include "llm_codec.h"
+#include "llm_console.h"
+#include "llm_profile.h"
+#include "llm_alloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -18,19 +22,69 @@
 #include "esp_system.h"
 #include "esp_dsp.h"
 #include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "esp_task_wdt.h"  // Add at top of llm.c
 
 #define MAP_FAILED NULL
 #define munmap(ptr, length) custom_munmap(ptr)
 #define close(fd) custom_close(fd)
 
-#define TASK_0_BIT (1 << 0)
-#define TASK_1_BIT (1 << 1)
-#define FORWARD_TASK_1 (1 << 2)
-#define FORWARD_TASK_2 (1 << 3)
-#define READY_BIT (1 << 3)
-#define ALL_SYNC_BITS (TASK_0_BIT | TASK_1_BIT)
-#define ALL_FORWARD_TASKS (FORWARD_TASK_1 | FORWARD_TASK_2)
+#define SLOT_READY_BIT(slot) (1 << (slot))
+#define LOADER_STOPPED_BIT (1 << 2)
+#define LOADER_STOP -1 // LayerRequest.layer asking the loader to exit
+#define EXT_MAGIC 0x584d4c4c // "LLMX"
+
+// debug logs inside forward() cost a level check and the evaluation of their
+// arguments per layer even when filtered, they are only compiled in on request
+#ifdef CONFIG_LLM_HOT_PATH_LOGS
+#define HOT_LOGD(...) ESP_LOGD(TAG, __VA_ARGS__)
+#else
+#define HOT_LOGD(...) do {} while (0)
+#endif
+
+// cycle counts of the forward pass ops, see llm_profile.h. compiled out
+// unless CONFIG_LLM_PROFILE
+#ifdef CONFIG_LLM_PROFILE
+#define PROFILE_CLOCK() esp_cpu_get_cycle_count()
+#define PROFILE_ADD(total, since) ((total) += esp_cpu_get_cycle_count() - (since))
+// both skip a transformer whose profile could not be allocated
+#define PROFILE_START(t) do { if ((t)->profile) profile_start((t)->profile); } while (0)
+#define PROFILE_MARK(t, layer, op) do { if ((t)->profile) profile_lap((t), (layer), (op)); } while (0)
+#else
+#define PROFILE_CLOCK() 0
+#define PROFILE_ADD(total, since) ((void)(since))
+#define PROFILE_START(t) do {} while (0)
+#define PROFILE_MARK(t, layer, op) do {} while (0)
+#endif
+
+#ifndef CONFIG_LLM_SPECULATE_TOKENS
+#define CONFIG_LLM_SPECULATE_TOKENS 0
+#endif
+#ifndef CONFIG_LLM_CLASSIFIER_SHORTLIST
+#define CONFIG_LLM_CLASSIFIER_SHORTLIST 0
+#endif
+#ifndef CONFIG_LLM_SHORTLIST_MARGIN
+#define CONFIG_LLM_SHORTLIST_MARGIN 50
+#endif
+
+typedef enum
+{
+    EXT_SPARSE = 1,  // block sparse replacement for a layer tensor
+    EXT_LOWRANK = 2, // U @ V replacement for a layer tensor or the classifier
+    EXT_DROPPED = 3, // closes the file when dense tensors were left out, see dropped_tensors()
+} ExtensionKind;
+
+typedef struct
+{
+    // checkpoint extensions follow the regular llama2.c weights, each one
+    // is this header followed by size bytes of payload
+    uint32_t magic; // EXT_MAGIC
+    uint32_t kind;  // ExtensionKind
+    uint32_t tensor; // LayerTensor
+    uint32_t layer;
+    uint32_t size; // a multiple of 4 so the next header stays aligned
+} ExtensionHeader;
 
 typedef struct
 {
@@ -41,7 +95,12 @@ typedef struct
     int end;
     int n;
     int d;
-    int task_num;
+    const SparseMatrix *sparse; // block sparse weights to use instead of w
+    int argmax;    // track the best row instead of writing xout
+    const uint16_t *skip; // rows with a nonzero entry are left out of the argmax
+    int best;      // the worker's best row when argmax is set
+    v4sf best_val; // and its value
+    int batch;     // vectors in x (batch, n) and xout (batch, d), 0 is a single one
 } MatMulTaskParams;
 
 typedef struct
@@ -49,6 +108,8 @@ typedef struct
     RunState *s;
     TransformerWeights *w;
     Config *p;
+    v4sf *q;  // query of the position, (dim,)
+    v4sf *xb; // attention output of the position, (dim,)
     int pos;
     int start;
     int loff;
@@ -58,28 +119,54 @@ typedef struct
     int kv_mul;
     int hidden_dim;
     int head_size;
-    int task_num;
 } ForwardTaskParams;
 
-EventGroupHandle_t xEventGroup;
-EventGroupHandle_t ForwardEventGroup;
+struct WorkerPool
+{
+    // the second core's share of every matmul and attention. each transformer
+    // has its own, so models can be built, used and freed independently.
+    // a worker waits on its start semaphore and gives done once its half is
+    // written, the caller never takes back a semaphore it gave itself
+    MatMulTaskParams matmul;
+    ForwardTaskParams forward;
+    SemaphoreHandle_t matmul_start;
+    SemaphoreHandle_t matmul_done;
+    SemaphoreHandle_t forward_start;
+    SemaphoreHandle_t forward_done;
+    TaskHandle_t matmul_task;
+    TaskHandle_t forward_task;
+    // for the profiler, since the last op was charged
+    uint32_t wait_cycles; // the caller waiting for the second core
+    uint32_t worker_cycles; // the second core working on its share
+};
+
+typedef struct
+{
+    int layer;
+    int slot;
+} LayerRequest;
+
 
 static const char *TAG = "LLM";
-TaskHandle_t handle_forward_task = NULL;
-TaskHandle_t matmul_task_2 = NULL;
+// the loader adds to the streaming counters while generate() resets and reads them
+static portMUX_TYPE stream_stats_lock = portMUX_INITIALIZER_UNLOCKED;
 
-ForwardTaskParams *forward_params = NULL;
-MatMulTaskParams *matmul_params = NULL;
 
-SemaphoreHandle_t semaDataReady;
-SemaphoreHandle_t semaForwardDataReady;
 
 void matmul_task(void *params);
 void forward_task(void *params);
+WorkerPool *build_workers(void);
+void free_workers(WorkerPool *pool);
+void sparse_rows(const SparseMatrix *m, v4sf *x, v4sf *xout, int start, int end);
+int argmax_rows(v4sf *x, v4sf *w, int n, int start, int end, const uint16_t *skip, v4sf *best_val);
+int sample_argmax(v4sf *probabilities, int n);
+v4sf penalize(Sampler *sampler, int token, v4sf logit);
+void apply_penalties(Sampler *sampler, v4sf *logits);
+void layer_loader_task(void *params);
 
 void custom_munmap(void *ptr)
 {
-    free(ptr);
+    mem_free(ptr, MEM_WEIGHTS);
 }
 
 int custom_close(int fd)
@@ -91,43 +178,171 @@ int custom_close(int fd)
 void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
           char *cli_user_prompt, char *cli_system_prompt, int steps);
 
-void malloc_run_state(RunState *s, Config *p)
+#define ARENA_ALIGN 64 // the SIMD dot product wants 16 bytes, a whole cache line keeps buffers apart
+#define ARENA_POISON 0xa5
+#ifdef CONFIG_LLM_ARENA_GUARDS
+#define ARENA_GUARD ARENA_ALIGN // poisoned bytes after each buffer, checked by check_run_state()
+#else
+#define ARENA_GUARD 0
+#endif
+#define ARENA_BUFFERS 18
+
+typedef struct
+{
+    const char *name;
+    v4sf **buffer;
+    size_t floats;
+    int region; // ArenaRegion
+} ArenaBuffer;
+
+static inline size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+int run_state_buffers(RunState *s, Config *p, ArenaBuffer *buffers)
 {
-    // we calloc instead of malloc to keep valgrind happy
+    // every RunState buffer, its size and where it lives. the small activations
+    // every kernel touches stay in internal RAM, the kv cache and the batch
+    // logits are large and read once per position, they go to PSRAM
     int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    s->x = calloc(p->dim, sizeof(v4sf));
-    s->xb = calloc(p->dim, sizeof(v4sf));
-    s->xb2 = calloc(p->dim, sizeof(v4sf));
-    s->hb = calloc(p->hidden_dim, sizeof(v4sf));
-    s->hb2 = calloc(p->hidden_dim, sizeof(v4sf));
-    s->q = calloc(p->dim, sizeof(v4sf));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(v4sf));
-    s->logits = calloc(p->vocab_size, sizeof(v4sf));
-    // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q || !s->key_cache || !s->value_cache || !s->att || !s->logits)
+    size_t kv_size = (size_t)p->n_layers * p->seq_len * kv_dim;
+    ArenaBuffer table[ARENA_BUFFERS] = {
+        {"x", &s->x, p->dim, ARENA_INTERNAL},
+        {"xb", &s->xb, p->dim, ARENA_INTERNAL},
+        {"xb2", &s->xb2, p->dim, ARENA_INTERNAL},
+        {"hb", &s->hb, p->hidden_dim, ARENA_INTERNAL},
+        {"hb2", &s->hb2, p->hidden_dim, ARENA_INTERNAL},
+        {"q", &s->q, p->dim, ARENA_INTERNAL},
+        {"att", &s->att, p->n_heads * p->seq_len, ARENA_INTERNAL},
+        {"logits", &s->logits, p->vocab_size, ARENA_INTERNAL},
+        {"lowrank", &s->lowrank, s->max_rank, ARENA_INTERNAL},
+        {"bx", &s->bx, s->max_batch * p->dim, ARENA_INTERNAL},
+        {"bxb", &s->bxb, s->max_batch * p->dim, ARENA_INTERNAL},
+        {"bxb2", &s->bxb2, s->max_batch * p->dim, ARENA_INTERNAL},
+        {"bhb", &s->bhb, s->max_batch * p->hidden_dim, ARENA_INTERNAL},
+        {"bhb2", &s->bhb2, s->max_batch * p->hidden_dim, ARENA_INTERNAL},
+        {"bq", &s->bq, s->max_batch * p->dim, ARENA_INTERNAL},
+        {"blogits", &s->blogits, s->max_batch * p->vocab_size, ARENA_PSRAM},
+        {"key_cache", &s->key_cache, kv_size, ARENA_PSRAM},
+        {"value_cache", &s->value_cache, kv_size, ARENA_PSRAM},
+    };
+    memcpy(buffers, table, sizeof(table));
+    return ARENA_BUFFERS;
+}
+
+static inline MemTag arena_tag(int region)
+{
+    return region == ARENA_INTERNAL ? MEM_ACTIVATIONS : MEM_KV_CACHE;
+}
+
+void *arena_alloc(size_t size, int region, MemTag tag)
+{
+    // falls back to any byte addressable memory, PSRAM may be missing and
+    // internal RAM may not fit a larger model's activations
+    uint32_t caps = region == ARENA_INTERNAL ? MALLOC_CAP_INTERNAL : MALLOC_CAP_SPIRAM;
+    void *arena = mem_aligned_calloc(ARENA_ALIGN, 1, size, tag, caps | MALLOC_CAP_8BIT);
+    if (arena == NULL)
     {
-        fprintf(stderr, "malloc failed!\n");
-        exit(EXIT_FAILURE);
+        arena = mem_aligned_calloc(ARENA_ALIGN, 1, size, tag, MALLOC_CAP_8BIT);
+    }
+    return arena;
+}
+
+void malloc_run_state(RunState *s, Config *p, int max_rank)
+{
+    // one arena per memory region, carved into cache line aligned buffers.
+    // calloc'd, to keep valgrind happy
+    s->max_batch = CONFIG_LLM_SPECULATE_TOKENS + 1;
+    s->max_rank = max_rank;
+    ArenaBuffer buffers[ARENA_BUFFERS];
+    int n = run_state_buffers(s, p, buffers);
+    size_t size[ARENA_REGIONS] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        size[buffers[i].region] += arena_align(buffers[i].floats * sizeof(v4sf)) + ARENA_GUARD;
+    }
+    for (int r = 0; r < ARENA_REGIONS; r++)
+    {
+        s->arena[r] = arena_alloc(size[r], r, arena_tag(r));
+        if (!s->arena[r])
+        {
+            fprintf(stderr, "malloc failed!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *next[ARENA_REGIONS] = {s->arena[ARENA_INTERNAL], s->arena[ARENA_PSRAM]};
+    for (int i = 0; i < n; i++)
+    {
+        ArenaBuffer *b = &buffers[i];
+        size_t used = b->floats * sizeof(v4sf);
+        *b->buffer = (v4sf *)next[b->region];
+        next[b->region] += arena_align(used) + ARENA_GUARD;
+        // the padding and the guard band, checked by check_run_state()
+        memset((char *)*b->buffer + used, ARENA_POISON, arena_align(used) - used + ARENA_GUARD);
+    }
+    ESP_LOGI(TAG, "RunState: %zu bytes of activations, %zu bytes of kv cache", size[ARENA_INTERNAL],
+             size[ARENA_PSRAM]);
+}
+
+void check_run_state(RunState *s, Config *p)
+{
+    // with CONFIG_LLM_ARENA_GUARDS, stops on the first buffer that was written past its end
+#ifdef CONFIG_LLM_ARENA_GUARDS
+    ArenaBuffer buffers[ARENA_BUFFERS];
+    int n = run_state_buffers(s, p, buffers);
+    for (int i = 0; i < n; i++)
+    {
+        size_t used = buffers[i].floats * sizeof(v4sf);
+        const uint8_t *guard = (const uint8_t *)*buffers[i].buffer + used;
+        for (size_t j = 0; j < arena_align(used) - used + ARENA_GUARD; j++)
+        {
+            if (guard[j] != ARENA_POISON)
+            {
+                ESP_LOGE(TAG, "RunState buffer %s overran by at least %zu bytes", buffers[i].name, j + 1);
+                abort();
+            }
+        }
+    }
+#endif
+}
+
+void log_memory_map(Transformer *t)
+{
+    // the tagged totals, then the tensors the RunState arenas are carved into
+    static const char *regions[ARENA_REGIONS] = {"internal", "psram"};
+    mem_log_map();
+    ArenaBuffer buffers[ARENA_BUFFERS];
+    int n = run_state_buffers(&t->state, &t->config, buffers);
+    for (int i = 0; i < n; i++)
+    {
+        ArenaBuffer *b = &buffers[i];
+        ESP_LOGI(TAG, "RunState %-12s %10zu bytes, %s arena", b->name, arena_align(b->floats * sizeof(v4sf)) + ARENA_GUARD,
+                 regions[b->region]);
     }
 }
 
 void free_run_state(RunState *s)
 {
-    free(s->x);
-    free(s->xb);
-    free(s->xb2);
-    free(s->hb);
-    free(s->hb2);
-    free(s->q);
-    free(s->att);
-    free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
+    for (int r = 0; r < ARENA_REGIONS; r++)
+    {
+        mem_free(s->arena[r], arena_tag(r));
+    }
+}
+
+static v4sf *map_tensor(v4sf **ptr, unsigned long long n, uint32_t dropped, int tensor)
+{
+    // a dense tensor left out of the file takes no space and maps to NULL
+    if (dropped & (1u << tensor))
+    {
+        return NULL;
+    }
+    v4sf *start = *ptr;
+    *ptr += n;
+    return start;
 }
 
-void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_weights)
+void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_weights, uint32_t dropped)
 {
     int head_size = p->dim / p->n_heads;
     // make sure the multiplications below are done in 64bit to fit the parameter counts of 13B+ models
@@ -136,40 +351,242 @@ void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_
     ptr += p->vocab_size * p->dim;
     w->rms_att_weight = ptr;
     ptr += n_layers * p->dim;
-    w->wq = ptr;
-    ptr += n_layers * p->dim * (p->n_heads * head_size);
-    w->wk = ptr;
-    ptr += n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wv = ptr;
-    ptr += n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wo = ptr;
-    ptr += n_layers * (p->n_heads * head_size) * p->dim;
+    w->wq = map_tensor(&ptr, n_layers * p->dim * (p->n_heads * head_size), dropped, TENSOR_WQ);
+    w->wk = map_tensor(&ptr, n_layers * p->dim * (p->n_kv_heads * head_size), dropped, TENSOR_WK);
+    w->wv = map_tensor(&ptr, n_layers * p->dim * (p->n_kv_heads * head_size), dropped, TENSOR_WV);
+    w->wo = map_tensor(&ptr, n_layers * (p->n_heads * head_size) * p->dim, dropped, TENSOR_WO);
     w->rms_ffn_weight = ptr;
     ptr += n_layers * p->dim;
-    w->w1 = ptr;
-    ptr += n_layers * p->dim * p->hidden_dim;
-    w->w2 = ptr;
-    ptr += n_layers * p->hidden_dim * p->dim;
-    w->w3 = ptr;
-    ptr += n_layers * p->dim * p->hidden_dim;
+    w->w1 = map_tensor(&ptr, n_layers * p->dim * p->hidden_dim, dropped, TENSOR_W1);
+    w->w2 = map_tensor(&ptr, n_layers * p->hidden_dim * p->dim, dropped, TENSOR_W2);
+    w->w3 = map_tensor(&ptr, n_layers * p->dim * p->hidden_dim, dropped, TENSOR_W3);
     w->rms_final_weight = ptr;
     ptr += p->dim;
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
-    w->wcls = shared_weights ? w->token_embedding_table : ptr;
+    w->wcls = shared_weights ? w->token_embedding_table : map_tensor(&ptr, 0, dropped, TENSOR_WCLS);
+}
+
+static const char *tensor_names[] = {"wq", "wk", "wv", "wo", "w1", "w2", "w3", "wcls"};
+
+void tensor_shape(Config *p, int tensor, int *rows, int *cols)
+{
+    // (rows, cols) of a matmul weight, rows being the output dimension
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    switch (tensor)
+    {
+    case TENSOR_WK:
+    case TENSOR_WV:
+        *rows = kv_dim;
+        *cols = p->dim;
+        break;
+    case TENSOR_W1:
+    case TENSOR_W3:
+        *rows = p->hidden_dim;
+        *cols = p->dim;
+        break;
+    case TENSOR_W2:
+        *rows = p->dim;
+        *cols = p->hidden_dim;
+        break;
+    case TENSOR_WCLS:
+        *rows = p->vocab_size;
+        *cols = p->dim;
+        break;
+    default: // wq, wo
+        *rows = p->dim;
+        *cols = p->dim;
+    }
+}
+
+size_t checkpoint_size(Config *p, int shared_weights, uint32_t dropped)
+{
+    // size in bytes of the llama2.c weights less the dropped tensors, extensions start here
+    size_t n_layers = p->n_layers;
+    int head_size = p->dim / p->n_heads;
+    size_t floats = (size_t)p->vocab_size * p->dim + 2 * n_layers * p->dim + p->dim;
+    for (int i = 0; i < LAYER_TENSORS; i++)
+    {
+        if (dropped & (1u << i))
+        {
+            continue;
+        }
+        int rows, cols;
+        tensor_shape(p, i, &rows, &cols);
+        floats += n_layers * rows * cols;
+    }
+    floats += p->seq_len * head_size; // what used to be freq_cis_real and freq_cis_imag
+    if (!shared_weights && !(dropped & (1u << TENSOR_WCLS)))
+    {
+        floats += (size_t)p->vocab_size * p->dim;
+    }
+    return sizeof(Config) + floats * sizeof(v4sf);
+}
+
+void map_sparse(SparseMatrix *m, Config *p, ExtensionHeader *h, char *payload)
+{
+    // payload: rows, cols, block, nnz_blocks, then row_ptr, block_col padded
+    // to 4 bytes and the values of the nonzero blocks
+    uint32_t *header = (uint32_t *)payload;
+    m->rows = header[0];
+    m->cols = header[1];
+    m->block = header[2];
+    m->nnz_blocks = header[3];
+    int rows, cols;
+    tensor_shape(p, h->tensor, &rows, &cols);
+    size_t values = (size_t)m->nnz_blocks * m->block * sizeof(v4sf);
+    size_t expected = 4 * sizeof(uint32_t) + (rows + 1) * sizeof(uint32_t) + ((m->nnz_blocks * sizeof(uint16_t) + 3) & ~3) + values;
+    if (m->rows != rows || m->cols != cols || m->block <= 0 || cols % m->block != 0 || h->size != expected)
+    {
+        ESP_LOGE(TAG, "Bad sparse %s for layer %lu", tensor_names[h->tensor], (unsigned long)h->layer);
+        exit(EXIT_FAILURE);
+    }
+    m->row_ptr = header + 4;
+    m->block_col = (const uint16_t *)(m->row_ptr + rows + 1);
+    m->values = (const v4sf *)(payload + expected - values);
+    if (m->row_ptr[rows] != m->nnz_blocks)
+    {
+        ESP_LOGE(TAG, "Bad sparse %s for layer %lu", tensor_names[h->tensor], (unsigned long)h->layer);
+        exit(EXIT_FAILURE);
+    }
+    // split the rows so both cores get about half of the nonzero blocks
+    m->split_row = 0;
+    while (m->split_row < rows && m->row_ptr[m->split_row] < m->nnz_blocks / 2)
+    {
+        m->split_row++;
+    }
+}
+
+void map_lowrank(LowRankMatrix *m, Config *p, ExtensionHeader *h, char *payload)
+{
+    // payload: rows, cols, rank, then U and V
+    uint32_t *header = (uint32_t *)payload;
+    m->rows = header[0];
+    m->cols = header[1];
+    m->rank = header[2];
+    int rows, cols;
+    tensor_shape(p, h->tensor, &rows, &cols);
+    size_t expected = 3 * sizeof(uint32_t) + (size_t)m->rank * (rows + cols) * sizeof(v4sf);
+    if (m->rows != rows || m->cols != cols || m->rank <= 0 || h->size != expected)
+    {
+        ESP_LOGE(TAG, "Bad low-rank %s for layer %lu", tensor_names[h->tensor], (unsigned long)h->layer);
+        exit(EXIT_FAILURE);
+    }
+    m->u = (const v4sf *)(header + 3);
+    m->v = m->u + (size_t)rows * m->rank;
+}
+
+int tensor_replaced(TransformerWeights *w, int layer, int tensor)
+{
+    // whether forward() never reads the dense copy of a layer tensor
+    int i = layer * LAYER_TENSORS + tensor;
+    return w->sparse[i].rows != 0 || w->lowrank[i].rank != 0;
+}
+
+uint32_t dropped_tensors(const void *tail)
+{
+    // tools may leave out the dense copies of tensors they replaced (one bit
+    // per LayerTensor), which then take no space in the llama2.c layout. an
+    // empty EXT_DROPPED extension ending the file lists them
+    ExtensionHeader h;
+    memcpy(&h, tail, sizeof(h));
+    return h.magic == EXT_MAGIC && h.kind == EXT_DROPPED && h.size == 0 ? h.tensor : 0;
+}
+
+void map_extensions(TransformerWeights *w, Config *p, char *ptr, char *end, uint32_t dropped)
+{
+    w->sparse = mem_calloc(p->n_layers * LAYER_TENSORS, sizeof(SparseMatrix), MEM_WEIGHT_TABLES, MEM_CAPS_DEFAULT);
+    w->lowrank = mem_calloc(p->n_layers * LAYER_TENSORS + 1, sizeof(LowRankMatrix), MEM_WEIGHT_TABLES, MEM_CAPS_DEFAULT);
+    if (w->sparse == NULL || w->lowrank == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
+    while (end - ptr >= (long)sizeof(ExtensionHeader))
+    {
+        ExtensionHeader *h = (ExtensionHeader *)ptr;
+        ptr += sizeof(ExtensionHeader);
+        if (h->magic != EXT_MAGIC || h->size > (size_t)(end - ptr))
+        {
+            ESP_LOGE(TAG, "Corrupt checkpoint extension");
+            exit(EXIT_FAILURE);
+        }
+        if (h->kind == EXT_SPARSE && h->tensor < LAYER_TENSORS && h->layer < p->n_layers)
+        {
+            SparseMatrix *m = &w->sparse[h->layer * LAYER_TENSORS + h->tensor];
+            map_sparse(m, p, h, ptr);
+            ESP_LOGI(TAG, "Layer %lu %s is block sparse, %d%% of weights kept", (unsigned long)h->layer,
+                     tensor_names[h->tensor], (int)(100LL * m->nnz_blocks * m->block / ((long long)m->rows * m->cols)));
+        }
+        else if (h->kind == EXT_LOWRANK && (h->tensor == TENSOR_WCLS || (h->tensor < LAYER_TENSORS && h->layer < p->n_layers)))
+        {
+            // the classifier isn't per layer, it goes last
+            int i = h->tensor == TENSOR_WCLS ? p->n_layers * LAYER_TENSORS : h->layer * LAYER_TENSORS + h->tensor;
+            LowRankMatrix *m = &w->lowrank[i];
+            map_lowrank(m, p, h, ptr);
+            ESP_LOGI(TAG, "Layer %lu %s has rank %d, %d%% of weights kept", (unsigned long)h->layer,
+                     tensor_names[h->tensor], m->rank, (int)(100LL * m->rank * (m->rows + m->cols) / ((long long)m->rows * m->cols)));
+        }
+        else if (h->kind != EXT_DROPPED)
+        {
+            ESP_LOGW(TAG, "Skipping unknown checkpoint extension %lu", (unsigned long)h->kind);
+        }
+        ptr += h->size;
+    }
+    for (int i = 0; i < LAYER_TENSORS; i++)
+    {
+        for (int l = 0; (dropped & (1u << i)) && l < p->n_layers; l++)
+        {
+            if (!tensor_replaced(w, l, i))
+            {
+                ESP_LOGE(TAG, "Checkpoint left out %s but layer %d has no replacement", tensor_names[i], l);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if ((dropped & (1u << TENSOR_WCLS)) && w->lowrank[p->n_layers * LAYER_TENSORS].rank == 0)
+    {
+        ESP_LOGE(TAG, "Checkpoint left out wcls but has no low-rank classifier");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weights,
                      int *fd, v4sf **data, size_t *file_size)
 {
+    int64_t load_start = esp_timer_get_time();
     FILE *file = fopen(checkpoint, "rb");
     if (!file)
     {
         ESP_LOGE(TAG, "Couldn't open file %s", checkpoint);
         exit(EXIT_FAILURE);
     }
+    // compressed checkpoints are decompressed chunk by chunk straight into the weights
+    CodecHeader codec;
+    int compressed = codec_read_header(file, &codec);
+    long flash_size = 0;
+    if (compressed)
+    {
+        fseek(file, 0, SEEK_END);
+        flash_size = ftell(file);
+        fseek(file, sizeof(CodecHeader), SEEK_SET);
+        *file_size = codec.raw_size;
+        *data = mem_malloc(*file_size, MEM_WEIGHTS, MEM_CAPS_DEFAULT);
+        if (*data == NULL)
+        {
+            ESP_LOGE(TAG, "Malloc operation failed");
+            exit(EXIT_FAILURE);
+        }
+        if (codec_decompress(file, &codec, *data) != 0)
+        {
+            ESP_LOGE(TAG, "Failed to decompress checkpoint");
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+        memcpy(config, *data, sizeof(Config));
+    }
     // read in the config header
-    if (fread(config, sizeof(Config), 1, file) != 1)
+    else if (fread(config, sizeof(Config), 1, file) != 1)
     {
         exit(EXIT_FAILURE);
     }
@@ -177,165 +594,538 @@ void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weigh
     int shared_weights = config->vocab_size > 0 ? 1 : 0;
     config->vocab_size = abs(config->vocab_size);
     ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
-    // figure out the file size
-    fseek(file, 0, SEEK_END); // move file pointer to end of file
-    *file_size = ftell(file); // get the file size, in bytes
-    fseek(file, 0, SEEK_SET); // move back to beginning for reading
-    ESP_LOGI(TAG, "File size: %zu bytes", *file_size);
+    if (!compressed)
+    {
+        // figure out the file size
+        fseek(file, 0, SEEK_END); // move file pointer to end of file
+        *file_size = ftell(file); // get the file size, in bytes
+        fseek(file, 0, SEEK_SET); // move back to beginning for reading
+        flash_size = *file_size;
+        ESP_LOGI(TAG, "File size: %zu bytes", *file_size);
+        ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
+        *data = mem_malloc(*file_size, MEM_WEIGHTS, MEM_CAPS_DEFAULT);
+        if (*data == NULL)
+        {
+            ESP_LOGE(TAG, "Malloc operation failed");
+            exit(EXIT_FAILURE);
+        }
+        // Read the entire file into memory
+        size_t bytes_read = fread(*data, 1, *file_size, file);
+        if (bytes_read != *file_size)
+        {
+            ESP_LOGE(TAG, "Failed to read file into memory");
+            ESP_LOGE(TAG, "Bytes read %zu bytes", bytes_read);
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+    }
+
+    ESP_LOGI(TAG, "Successfully read LLM into memory");
+    ESP_LOGI(TAG, "Loaded %zu bytes from %ld bytes of flash in %lld ms", *file_size, flash_size,
+             (esp_timer_get_time() - load_start) / 1000);
     ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
-    *data = malloc(*file_size);
-    if (*data == NULL)
+    uint32_t dropped = 0;
+    if (*file_size >= sizeof(Config) + sizeof(ExtensionHeader))
     {
-        ESP_LOGE(TAG, "Malloc operation failed");
-        exit(EXIT_FAILURE);
+        dropped = dropped_tensors((char *)*data + *file_size - sizeof(ExtensionHeader));
     }
-    // Read the entire file into memory
-    size_t bytes_read = fread(*data, 1, *file_size, file);
-    if (bytes_read != *file_size)
+    size_t payload = checkpoint_size(config, shared_weights, dropped);
+    if (payload > *file_size)
     {
-        ESP_LOGE(TAG, "Failed to read file into memory");
-        ESP_LOGE(TAG, "Bytes read %zu bytes", bytes_read);
+        ESP_LOGE(TAG, "Checkpoint is truncated, expected %zu bytes", payload);
         exit(EXIT_FAILURE);
     }
-    fclose(file);
-
-    ESP_LOGI(TAG, "Successfully read LLM into memory");
-    ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
     v4sf *weights_ptr = *data + sizeof(Config) / sizeof(v4sf);
-    memory_map_weights(weights, config, weights_ptr, shared_weights);
+    memory_map_weights(weights, config, weights_ptr, shared_weights, dropped);
+    map_extensions(weights, config, (char *)*data + payload, (char *)*data + *file_size, dropped);
     ESP_LOGI(TAG, "Successfully read checkpoint");
 }
 
-void build_transformer(Transformer *t, char *checkpoint_path)
+void layer_loader_task(void *params)
 {
-    // read in the Config and the Weights from the checkpoint
-    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
-    // allocate the RunState buffers
-    malloc_run_state(&t->state, &t->config);
-    ESP_LOGI(TAG, "Transformer successfully built");
+    LayerStream *ls = (LayerStream *)params;
+    LayerRequest req;
+    for (;;)
+    {
+        if (xQueueReceive(ls->requests, &req, portMAX_DELAY) == pdTRUE)
+        {
+            if (req.layer == LOADER_STOP)
+            {
+                // requests are served in order, every earlier load has finished
+                xEventGroupSetBits(ls->ready, LOADER_STOPPED_BIT);
+                vTaskDelete(NULL);
+            }
+            int64_t start = esp_timer_get_time();
+            size_t bytes = 0;
+            v4sf *dst = ls->slots[req.slot];
+            for (int i = 0; i < LAYER_TENSORS; i++)
+            {
+                size_t n = ls->tensor_size[i];
+                if (tensor_replaced(ls->weights, req.layer, i))
+                {
+                    dst += n; // replaced by a resident sparse or low-rank matrix
+                    continue;
+                }
+                long offset = ls->tensor_offset[i] + (long)(req.layer * n * sizeof(v4sf));
+                if (fseek(ls->file, offset, SEEK_SET) != 0 || fread(dst, sizeof(v4sf), n, ls->file) != n)
+                {
+                    ESP_LOGE(TAG, "Failed to stream layer %d", req.layer);
+                    exit(EXIT_FAILURE);
+                }
+                dst += n;
+                bytes += n * sizeof(v4sf);
+            }
+            int64_t elapsed = esp_timer_get_time() - start;
+            taskENTER_CRITICAL(&stream_stats_lock);
+            ls->read_bytes += bytes;
+            ls->read_us += elapsed;
+            taskEXIT_CRITICAL(&stream_stats_lock);
+            xEventGroupSetBits(ls->ready, SLOT_READY_BIT(req.slot));
+        }
+    }
+}
 
-    // FreeRTos Tasks
-    xEventGroup = xEventGroupCreate();
-    ForwardEventGroup = xEventGroupCreate();
-    semaDataReady = xSemaphoreCreateBinary();
-    semaForwardDataReady = xSemaphoreCreateBinary();
-    xSemaphoreGive(semaDataReady);
-    xSemaphoreTake(semaDataReady, portMAX_DELAY);
-    xSemaphoreGive(semaForwardDataReady);
-    xSemaphoreTake(semaForwardDataReady, portMAX_DELAY);
-
-    matmul_params = malloc(sizeof(MatMulTaskParams));
-    forward_params = malloc(sizeof(ForwardTaskParams));
-    xTaskCreatePinnedToCore(matmul_task, "MatMul2", 2048, matmul_params, 19, &matmul_task_2, 1);             // Run on Core 1
-    xTaskCreatePinnedToCore(forward_task, "ForwardTask", 2048, forward_params, 19, &handle_forward_task, 1); // Run on Core 1
-    ESP_LOGI(TAG, "Created FreeRTOS Tasks");
+void request_layer(LayerStream *ls, int layer, int slot)
+{
+    xEventGroupClearBits(ls->ready, SLOT_READY_BIT(slot));
+    ls->slot_layer[slot] = layer;
+    LayerRequest req = {layer, slot};
+    xQueueSend(ls->requests, &req, portMAX_DELAY);
 }
 
-void free_transformer(Transformer *t)
+void read_checkpoint_streamed(char *checkpoint, Config *config, TransformerWeights *weights,
+                              LayerStream *ls, v4sf **data, size_t *file_size)
 {
-    // close the memory mapping
-    if (t->data != MAP_FAILED)
+    FILE *file = fopen(checkpoint, "rb");
+    if (!file)
     {
-        munmap(t->data, t->file_size);
+        ESP_LOGE(TAG, "Couldn't open file %s", checkpoint);
+        exit(EXIT_FAILURE);
     }
-    if (t->fd != -1)
+    if (fread(config, sizeof(Config), 1, file) != 1)
     {
-        close(t->fd);
+        exit(EXIT_FAILURE);
+    }
+    int shared_weights = config->vocab_size > 0 ? 1 : 0;
+    config->vocab_size = abs(config->vocab_size);
+    fseek(file, 0, SEEK_END);
+    *file_size = ftell(file);
+    uint32_t dropped = 0;
+    ExtensionHeader tail;
+    if (*file_size >= sizeof(Config) + sizeof(tail) && fseek(file, -(long)sizeof(tail), SEEK_END) == 0 &&
+        fread(&tail, sizeof(tail), 1, file) == 1)
+    {
+        dropped = dropped_tensors(&tail);
     }
-    // free the RunState buffers
-    free_run_state(&t->state);
-}
-
-// ----------------------------------------------------------------------------
-// neural net blocks; the dynamics of the Transformer
 
-void rmsnorm(v4sf *o, v4sf *x, v4sf *weight, int size)
-{
-    // calculate sum of squares
-    v4sf ss = 0.0f;
-    for (int j = 0; j < size; j++)
+    // file layout in floats after the Config header, see memory_map_weights()
+    Config *p = config;
+    int head_size = p->dim / p->n_heads;
+    size_t n_layers = p->n_layers;
+    size_t embedding = (size_t)p->vocab_size * p->dim;
+    size_t sizes[LAYER_TENSORS]; // 0 for the dropped tensors, in the file and in the layer buffers
+    for (int i = 0; i < LAYER_TENSORS; i++)
     {
-        ss += x[j] * x[j];
+        int rows, cols;
+        tensor_shape(p, i, &rows, &cols);
+        sizes[i] = dropped & (1u << i) ? 0 : (size_t)rows * cols;
     }
-    ss /= size;
-    ss += 1e-5f;
-    ss = 1.0f / sqrtf(ss);
-    // normalize and scale
-    for (int j = 0; j < size; j++)
+    size_t off = embedding;
+    size_t rms_att_off = off;
+    off += n_layers * p->dim;
+    for (int i = 0; i < 4; i++)
     {
-        o[j] = weight[j] * (ss * x[j]);
+        ls->tensor_offset[i] = sizeof(Config) + off * sizeof(v4sf);
+        off += n_layers * sizes[i];
+    }
+    size_t rms_ffn_off = off;
+    off += n_layers * p->dim;
+    for (int i = 4; i < LAYER_TENSORS; i++)
+    {
+        ls->tensor_offset[i] = sizeof(Config) + off * sizeof(v4sf);
+        off += n_layers * sizes[i];
+    }
+    size_t rms_final_off = off;
+    off += p->dim;
+    off += p->seq_len * head_size; // skip what used to be freq_cis_real and freq_cis_imag
+    size_t wcls_off = off;
+
+    // the resident part: embeddings, rmsnorm weights and the classifier
+    size_t wcls_size = shared_weights || (dropped & (1u << TENSOR_WCLS)) ? 0 : embedding;
+    size_t resident = embedding + 2 * n_layers * p->dim + p->dim + wcls_size;
+    *data = mem_malloc(resident * sizeof(v4sf), MEM_WEIGHTS, MEM_CAPS_DEFAULT);
+    ls->layer_size = 0;
+    for (int i = 0; i < LAYER_TENSORS; i++)
+    {
+        ls->tensor_size[i] = sizes[i];
+        ls->layer_size += sizes[i];
+    }
+    ls->slots[0] = mem_malloc(ls->layer_size * sizeof(v4sf), MEM_LAYER_STREAM, MEM_CAPS_DEFAULT);
+    ls->slots[1] = mem_malloc(ls->layer_size * sizeof(v4sf), MEM_LAYER_STREAM, MEM_CAPS_DEFAULT);
+    if (*data == NULL || ls->slots[0] == NULL || ls->slots[1] == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
     }
-}
 
-void softmax(v4sf *x, int size)
-{
-    // find max value (for numerical stability)
-    v4sf max_val = x[0];
-    for (int i = 1; i < size; i++)
+    struct
     {
-        if (x[i] > max_val)
+        v4sf **dst;
+        size_t offset;
+        size_t n;
+    } parts[] = {
+        {&weights->token_embedding_table, 0, embedding},
+        {&weights->rms_att_weight, rms_att_off, n_layers * p->dim},
+        {&weights->rms_ffn_weight, rms_ffn_off, n_layers * p->dim},
+        {&weights->rms_final_weight, rms_final_off, p->dim},
+        {&weights->wcls, wcls_off, wcls_size},
+    };
+    v4sf *ptr = *data;
+    for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        *parts[i].dst = ptr;
+        fseek(file, sizeof(Config) + parts[i].offset * sizeof(v4sf), SEEK_SET);
+        if (fread(ptr, sizeof(v4sf), parts[i].n, file) != parts[i].n)
         {
-            max_val = x[i];
+            ESP_LOGE(TAG, "Failed to read resident weights");
+            exit(EXIT_FAILURE);
         }
+        ptr += parts[i].n;
     }
-    // exp and sum
-    v4sf sum = 0.0f;
-    for (int i = 0; i < size; i++)
+    if (shared_weights)
     {
-        x[i] = expf(x[i] - max_val);
-        sum += x[i];
+        weights->wcls = weights->token_embedding_table;
     }
-    // normalize
-    for (int i = 0; i < size; i++)
+    else if (wcls_size == 0)
     {
-        x[i] /= sum;
+        weights->wcls = NULL;
+    }
+    weights->wq = weights->wk = weights->wv = weights->wo = NULL;
+    weights->w1 = weights->w2 = weights->w3 = NULL;
+
+    // extensions are small next to the layers, keep them resident
+    size_t payload = checkpoint_size(p, shared_weights, dropped);
+    size_t ext_size = *file_size > payload ? *file_size - payload : 0;
+    ls->extensions = NULL;
+    if (ext_size > 0)
+    {
+        ls->extensions = mem_malloc(ext_size, MEM_LAYER_STREAM, MEM_CAPS_DEFAULT);
+        fseek(file, payload, SEEK_SET);
+        if (ls->extensions == NULL || fread(ls->extensions, 1, ext_size, file) != ext_size)
+        {
+            ESP_LOGE(TAG, "Failed to read checkpoint extensions");
+            exit(EXIT_FAILURE);
+        }
     }
+    map_extensions(weights, p, ls->extensions, (char *)ls->extensions + ext_size, dropped);
+    ls->weights = weights;
+
+    ls->enabled = 1;
+    ls->file = file;
+    ls->slot_layer[0] = ls->slot_layer[1] = -1;
+    ls->requests = xQueueCreate(2, sizeof(LayerRequest));
+    ls->ready = xEventGroupCreate();
+    xTaskCreatePinnedToCore(layer_loader_task, "LayerLoader", 4096, ls, 18, &ls->loader, 1);
+    // kick off the first layer so it is ready by the first forward()
+    request_layer(ls, 0, 0);
+    ESP_LOGI(TAG, "Streaming %d layers of %zu bytes, %zu bytes resident",
+             p->n_layers, ls->layer_size * sizeof(v4sf), resident * sizeof(v4sf));
 }
 
-void matmul_task(void *params)
+void get_layer_weights(Transformer *t, int l, LayerWeights *lw)
 {
-    const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
-    MatMulTaskParams *p = (MatMulTaskParams *)params;
-    TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
-    char *tName = pcTaskGetName(current_task);
-    // ESP_LOGI(TAG, "Created Task %s", tName);
-    for (;;)
+    Config *p = &t->config;
+    LayerStream *ls = &t->stream;
+    TransformerWeights *w = &t->weights;
+    for (int i = 0; i < LAYER_TENSORS; i++)
+    {
+        SparseMatrix *m = &w->sparse[l * LAYER_TENSORS + i];
+        lw->sparse[i] = m->rows != 0 ? m : NULL;
+        LowRankMatrix *lr = &w->lowrank[l * LAYER_TENSORS + i];
+        lw->lowrank[i] = lr->rank != 0 ? lr : NULL;
+    }
+    if (!ls->enabled)
     {
-        if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
+        v4sf *base[LAYER_TENSORS] = {w->wq, w->wk, w->wv, w->wo, w->w1, w->w2, w->w3};
+        for (int i = 0; i < LAYER_TENSORS; i++)
         {
-            //   ESP_LOGI(TAG, "Started Task %s", tName);
-            for (int i = p->start; i < p->end; i++)
-            {
-                v4sf val = 0.0f;
-                v4sf *row = &p->w[i * p->n]; // Pointer to the start of the current row in matrix w
-                dsps_dotprod_f32_aes3(row, p->x, &val, p->n);
-                p->xout[i] = val;
-            }
-            //    ESP_LOGI(TAG, "Completed task %s", tName);
-            xSemaphoreGive(semaDataReady);
-            xEventGroupSync(xEventGroup, p->task_num, ALL_SYNC_BITS, portMAX_DELAY);
+            int rows, cols;
+            tensor_shape(p, i, &rows, &cols);
+            lw->w[i] = base[i] ? base[i] + (size_t)l * rows * cols : NULL;
         }
+        return;
+    }
+    // the layer was requested while the previous one computed, wait for it
+    int slot = ls->slot_layer[0] == l ? 0 : 1;
+    if (ls->slot_layer[slot] != l)
+    {
+        request_layer(ls, l, slot);
+    }
+    int64_t start = esp_timer_get_time();
+    xEventGroupWaitBits(ls->ready, SLOT_READY_BIT(slot), pdFALSE, pdTRUE, portMAX_DELAY);
+    ls->stall_us += esp_timer_get_time() - start;
+    // prefetch the next layer (wrapping to layer 0 of the next token) into the other slot
+    int next = (l + 1) % p->n_layers;
+    if (next != l && ls->slot_layer[slot ^ 1] != next)
+    {
+        request_layer(ls, next, slot ^ 1);
+    }
+    v4sf *ptr = ls->slots[slot];
+    for (int i = 0; i < LAYER_TENSORS; i++)
+    {
+        lw->w[i] = ptr;
+        ptr += ls->tensor_size[i];
     }
 }
 
-void forward_task(void *params)
+void build_transformer(Transformer *t, char *checkpoint_path)
 {
-    const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
-    ForwardTaskParams *t_params = (ForwardTaskParams *)params;
-    TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
-    char *tName = pcTaskGetName(current_task);
-    // ESP_LOGI(TAG, "Created Task %s", tName);
-    for (;;)
+    // read in the Config and the Weights from the checkpoint. the whole checkpoint
+    // is loaded into RAM unless streaming is configured or it doesn't fit
+    int stream = 0;
+#ifdef CONFIG_LLM_STREAM_LAYERS
+    stream = 1;
+#endif
+    FILE *file = fopen(checkpoint_path, "rb");
+    if (file)
     {
-        if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
+        CodecHeader codec;
+        int compressed = codec_read_header(file, &codec);
+        fseek(file, 0, SEEK_END);
+        size_t size = compressed ? codec.raw_size : ftell(file);
+        fclose(file);
+        if (size > heap_caps_get_largest_free_block(MALLOC_CAP_8BIT))
         {
+            ESP_LOGW(TAG, "Checkpoint of %zu bytes doesn't fit in RAM, streaming layers", size);
+            stream = 1;
+        }
+        if (compressed && stream)
+        {
+            // layers are read at their file offset, which chunked compression doesn't preserve
+            ESP_LOGW(TAG, "Compressed checkpoints can't be streamed, loading it whole");
+            stream = 0;
+        }
+    }
+    t->stream.enabled = 0;
+    t->fd = -1;
+    if (stream)
+    {
+        read_checkpoint_streamed(checkpoint_path, &t->config, &t->weights, &t->stream, &t->data, &t->file_size);
+    }
+    else
+    {
+        read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
+    }
+    // allocate the RunState buffers
+    int max_rank = 1;
+    for (int i = 0; i <= t->config.n_layers * LAYER_TENSORS; i++)
+    {
+        max_rank = t->weights.lowrank[i].rank > max_rank ? t->weights.lowrank[i].rank : max_rank;
+    }
+    malloc_run_state(&t->state, &t->config, max_rank);
+    Shortlist *sl = &t->shortlist;
+    sl->size = 0;
+    sl->candidates = NULL;
+    sl->exact = NULL;
+    if (CONFIG_LLM_CLASSIFIER_SHORTLIST > 0)
+    {
+        if (t->weights.lowrank[t->config.n_layers * LAYER_TENSORS].rank == 0)
+        {
+            ESP_LOGW(TAG, "Checkpoint has no low-rank classifier, shortlist disabled");
+        }
+        else if (t->weights.wcls == NULL)
+        {
+            ESP_LOGW(TAG, "Checkpoint left out the dense classifier, shortlist disabled");
+        }
+        else if (CONFIG_LLM_CLASSIFIER_SHORTLIST >= t->config.vocab_size)
+        {
+            ESP_LOGW(TAG, "Shortlist covers the whole vocabulary, disabled");
+        }
+        else
+        {
+            // the low-rank classifier becomes the proxy instead of replacing wcls
+            sl->size = CONFIG_LLM_CLASSIFIER_SHORTLIST;
+            sl->margin = CONFIG_LLM_SHORTLIST_MARGIN / 100.0f;
+            sl->candidates = mem_malloc((sl->size + 1) * sizeof(int), MEM_SHORTLIST, MEM_CAPS_DEFAULT);
+            sl->exact = mem_malloc(sl->size * sizeof(float), MEM_SHORTLIST, MEM_CAPS_DEFAULT);
+            if (!sl->candidates || !sl->exact)
+            {
+                fprintf(stderr, "malloc failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            ESP_LOGI(TAG, "Classifier shortlist of %d tokens", sl->size);
+        }
+    }
+    t->pool = build_workers();
+    t->profile = NULL;
+#ifdef CONFIG_LLM_PROFILE
+    t->profile = profile_create(t->config.n_layers);
+    if (!t->profile)
+    {
+        ESP_LOGW(TAG, "Out of memory for the profile, profiling is off");
+    }
+#endif
+    log_memory_map(t);
+    ESP_LOGI(TAG, "Transformer successfully built");
+}
+
+void free_transformer(Transformer *t)
+{
+    // close the memory mapping
+    if (t->data != MAP_FAILED)
+    {
+        munmap(t->data, t->file_size);
+    }
+    if (t->fd != -1)
+    {
+        close(t->fd);
+    }
+    if (t->stream.enabled)
+    {
+        LayerStream *ls = &t->stream;
+        // the prefetch issued by the last forward() may still be reading into
+        // a slot, let the loader drain its queue and exit before freeing
+        LayerRequest stop = {LOADER_STOP, 0};
+        xQueueSend(ls->requests, &stop, portMAX_DELAY);
+        xEventGroupWaitBits(ls->ready, LOADER_STOPPED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        ls->loader = NULL;
+        vQueueDelete(ls->requests);
+        vEventGroupDelete(ls->ready);
+        mem_free(ls->slots[0], MEM_LAYER_STREAM);
+        mem_free(ls->slots[1], MEM_LAYER_STREAM);
+        mem_free(ls->extensions, MEM_LAYER_STREAM);
+        fclose(ls->file);
+        ls->enabled = 0;
+    }
+    free_workers(t->pool);
+    t->pool = NULL;
+    profile_free(t->profile);
+    t->profile = NULL;
+    mem_free(t->weights.sparse, MEM_WEIGHT_TABLES);
+    mem_free(t->weights.lowrank, MEM_WEIGHT_TABLES);
+    mem_free(t->shortlist.candidates, MEM_SHORTLIST);
+    mem_free(t->shortlist.exact, MEM_SHORTLIST);
+    // free the RunState buffers
+    check_run_state(&t->state, &t->config);
+    free_run_state(&t->state);
+}
+
+// ----------------------------------------------------------------------------
+// neural net blocks; the dynamics of the Transformer
+
+void rmsnorm(v4sf *o, v4sf *x, v4sf *weight, int size)
+{
+    // calculate sum of squares
+    v4sf ss = 0.0f;
+    for (int j = 0; j < size; j++)
+    {
+        ss += x[j] * x[j];
+    }
+    ss /= size;
+    ss += 1e-5f;
+    ss = 1.0f / sqrtf(ss);
+    // normalize and scale
+    for (int j = 0; j < size; j++)
+    {
+        o[j] = weight[j] * (ss * x[j]);
+    }
+}
+
+void softmax(v4sf *x, int size)
+{
+    // find max value (for numerical stability)
+    v4sf max_val = x[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (x[i] > max_val)
+        {
+            max_val = x[i];
+        }
+    }
+    // exp and sum
+    v4sf sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    // normalize
+    for (int i = 0; i < size; i++)
+    {
+        x[i] /= sum;
+    }
+}
+
+void sparse_rows(const SparseMatrix *m, v4sf *x, v4sf *xout, int start, int end)
+{
+    // zero blocks are skipped, each nonzero block is a dense SIMD dot product
+    for (int i = start; i < end; i++)
+    {
+        v4sf sum = 0.0f;
+        for (uint32_t b = m->row_ptr[i]; b < m->row_ptr[i + 1]; b++)
+        {
+            v4sf val = 0.0f;
+            dsps_dotprod_f32_aes3((v4sf *)m->values + b * m->block, x + m->block_col[b] * m->block, &val, m->block);
+            sum += val;
+        }
+        xout[i] = sum;
+    }
+}
+
+void matmul_task(void *params)
+{
+    WorkerPool *pool = (WorkerPool *)params;
+    MatMulTaskParams *p = &pool->matmul;
+    for (;;)
+    {
+        if (xSemaphoreTake(pool->matmul_start, portMAX_DELAY) == pdTRUE)
+        {
+            uint32_t start = PROFILE_CLOCK();
+            //   ESP_LOGI(TAG, "Started Task %s", tName);
+            if (p->sparse)
+            {
+                sparse_rows(p->sparse, p->x, p->xout, p->start, p->end);
+            }
+            else if (p->argmax)
+            {
+                p->best = argmax_rows(p->x, p->w, p->n, p->start, p->end, p->skip, &p->best_val);
+            }
+            else
+            {
+                int batch = p->batch > 0 ? p->batch : 1;
+                for (int i = p->start; i < p->end; i++)
+                {
+                    v4sf *row = &p->w[i * p->n]; // Pointer to the start of the current row in matrix w
+                    for (int b = 0; b < batch; b++)
+                    {
+                        v4sf val = 0.0f;
+                        dsps_dotprod_f32_aes3(row, p->x + b * p->n, &val, p->n);
+                        p->xout[b * p->d + i] = val;
+                    }
+                }
+            }
+            PROFILE_ADD(pool->worker_cycles, start);
+            xSemaphoreGive(pool->matmul_done);
+        }
+    }
+}
+
+void forward_task(void *params)
+{
+    WorkerPool *pool = (WorkerPool *)params;
+    ForwardTaskParams *t_params = &pool->forward;
+    for (;;)
+    {
+        if (xSemaphoreTake(pool->forward_start, portMAX_DELAY) == pdTRUE)
+        {
+            uint32_t start = PROFILE_CLOCK();
             //   ESP_LOGI(TAG, "Started Task %s", tName);
             int h;
             // #pragma omp parallel for private(h)
             for (h = t_params->start; h < t_params->end; h++)
             {
                 // get the query vector for this head
-                v4sf *q = t_params->s->q + h * t_params->head_size;
+                v4sf *q = t_params->q + h * t_params->head_size;
                 // attention scores for this head
                 v4sf *att = t_params->s->att + h * t_params->p->seq_len;
                 // iterate over all timesteps, including the current one
@@ -358,7 +1148,7 @@ void forward_task(void *params)
                 softmax(att, t_params->pos + 1);
 
                 // weighted sum of the values, store back into xb
-                v4sf *xb = t_params->s->xb + h * t_params->head_size;
+                v4sf *xb = t_params->xb + h * t_params->head_size;
                 memset(xb, 0, t_params->head_size * sizeof(v4sf));
                 for (int t = 0; t <= t_params->pos; t++)
                 {
@@ -373,237 +1163,1036 @@ void forward_task(void *params)
                     }
                 }
             }
-            //   ESP_LOGI(TAG, "Completed task %s", tName);
-            xSemaphoreGive(semaForwardDataReady);
-            xEventGroupSync(ForwardEventGroup, t_params->task_num, ALL_FORWARD_TASKS, portMAX_DELAY);
+            PROFILE_ADD(pool->worker_cycles, start);
+            xSemaphoreGive(pool->forward_done);
+        }
+    }
+}
+
+WorkerPool *build_workers(void)
+{
+    // FreeRTos Tasks on the second core, blocked on their start semaphore
+    // until a matmul or an attention hands them half of the work
+    WorkerPool *pool = mem_calloc(1, sizeof(WorkerPool), MEM_WORKERS, MEM_CAPS_DEFAULT);
+    if (!pool)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    pool->matmul_start = xSemaphoreCreateBinary();
+    pool->matmul_done = xSemaphoreCreateBinary();
+    pool->forward_start = xSemaphoreCreateBinary();
+    pool->forward_done = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(matmul_task, "MatMul2", 2048, pool, 19, &pool->matmul_task, 1);         // Run on Core 1
+    xTaskCreatePinnedToCore(forward_task, "ForwardTask", 2048, pool, 19, &pool->forward_task, 1); // Run on Core 1
+    ESP_LOGI(TAG, "Created FreeRTOS Tasks");
+    return pool;
+}
+
+void free_workers(WorkerPool *pool)
+{
+    // between forward passes both workers are blocked on their start
+    // semaphore and hold nothing, they can be deleted right away
+    if (!pool)
+    {
+        return;
+    }
+    vTaskDelete(pool->matmul_task);
+    vTaskDelete(pool->forward_task);
+    vSemaphoreDelete(pool->matmul_start);
+    vSemaphoreDelete(pool->matmul_done);
+    vSemaphoreDelete(pool->forward_start);
+    vSemaphoreDelete(pool->forward_done);
+    mem_free(pool, MEM_WORKERS);
+}
+
+void matmul_join(WorkerPool *pool)
+{
+    // wait for the second core to finish its share of the rows
+    uint32_t start = PROFILE_CLOCK();
+    xSemaphoreTake(pool->matmul_done, portMAX_DELAY);
+    PROFILE_ADD(pool->wait_cycles, start);
+}
+
+void matmul(WorkerPool *pool, v4sf *xout, v4sf *x, v4sf *w, int n, int d)
+{
+
+    // d is the number of rows
+    // n is the number of columns
+    // d X n
+    pool->matmul = (MatMulTaskParams){xout, x, w, d / 2, d, n, d};
+    xSemaphoreGive(pool->matmul_start);
+    for (int i = 0; i < d / 2; i++)
+    {
+        v4sf val = 0.0f;
+        v4sf *row = &w[i * n]; // Pointer to the start of the current row in matrix w
+        dsps_dotprod_f32_aes3(row, x, &val, n);
+        xout[i] = val;
+    }
+    matmul_join(pool);
+}
+
+int argmax_rows(v4sf *x, v4sf *w, int n, int start, int end, const uint16_t *skip, v4sf *best_val)
+{
+    // W[start:end] @ x reduced to its largest row, nothing is written out.
+    // ties keep the lowest row, like sample_argmax()
+    int best = start;
+    *best_val = -INFINITY;
+    for (int i = start; i < end; i++)
+    {
+        if (skip && skip[i])
+        {
+            continue;
+        }
+        v4sf val = 0.0f;
+        dsps_dotprod_f32_aes3(&w[i * n], x, &val, n);
+        if (val > *best_val)
+        {
+            best = i;
+            *best_val = val;
+        }
+    }
+    return best;
+}
+
+int matmul_argmax(WorkerPool *pool, v4sf *x, v4sf *w, int n, int d, const uint16_t *skip, v4sf *best_val)
+{
+    // argmax(W (d,n) @ x), each core keeps the top-1 of its half of the rows
+    pool->matmul = (MatMulTaskParams){NULL, x, w, d / 2, d, n, d, NULL, 1, skip};
+    xSemaphoreGive(pool->matmul_start);
+    int best = argmax_rows(x, w, n, 0, d / 2, skip, best_val);
+    matmul_join(pool);
+    if (pool->matmul.best_val > *best_val)
+    {
+        *best_val = pool->matmul.best_val;
+        best = pool->matmul.best;
+    }
+    return best;
+}
+
+void sparse_matmul(WorkerPool *pool, v4sf *xout, v4sf *x, const SparseMatrix *m)
+{
+    // same split as matmul(), at the row that balances the nonzero blocks
+    pool->matmul = (MatMulTaskParams){xout, x, NULL, m->split_row, m->rows, m->cols, m->rows, m};
+    xSemaphoreGive(pool->matmul_start);
+    sparse_rows(m, x, xout, 0, m->split_row);
+    matmul_join(pool);
+}
+
+void lowrank_matmul(WorkerPool *pool, v4sf *xout, v4sf *x, const LowRankMatrix *m, v4sf *tmp)
+{
+    // U (d,rank) @ (V (rank,n) @ x), both halves split across the cores as usual
+    matmul(pool, tmp, x, (v4sf *)m->v, m->cols, m->rank);
+    matmul(pool, xout, tmp, (v4sf *)m->u, m->rank, m->rows);
+}
+
+void project(WorkerPool *pool, RunState *s, v4sf *xout, v4sf *x, LayerWeights *lw, int tensor, int n, int d)
+{
+    // W (d,n) @ x (n,) -> xout (d,) for one of the layer's matmul weights
+    if (lw->lowrank[tensor])
+    {
+        lowrank_matmul(pool, xout, x, lw->lowrank[tensor], s->lowrank);
+    }
+    else if (lw->sparse[tensor])
+    {
+        sparse_matmul(pool, xout, x, lw->sparse[tensor]);
+    }
+    else
+    {
+        matmul(pool, xout, x, lw->w[tensor], n, d);
+    }
+}
+
+void top_candidates(v4sf *scores, int n, int k, int *out)
+{
+    // indices of the k highest scores, best first. k is small, so a sorted
+    // insertion beats sorting the whole vocabulary
+    int count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (count == k && scores[i] <= scores[out[k - 1]])
+        {
+            continue;
+        }
+        int j = count < k ? count++ : k - 1;
+        while (j > 0 && scores[out[j - 1]] < scores[i])
+        {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = i;
+    }
+}
+
+void classify_shortlist(Transformer *t, v4sf *x)
+{
+    // exact logits for the proxy's candidates, every other token is ruled out.
+    // proxy logits must not reach the sampler or the penalties, they would
+    // distort the distribution and could outrank a penalized exact winner
+    Config *p = &t->config;
+    TransformerWeights *w = &t->weights;
+    RunState *s = &t->state;
+    Shortlist *sl = &t->shortlist;
+    lowrank_matmul(t->pool, s->logits, x, &w->lowrank[p->n_layers * LAYER_TENSORS], s->lowrank);
+    top_candidates(s->logits, p->vocab_size, sl->size + 1, sl->candidates);
+    v4sf left_out = s->logits[sl->candidates[sl->size]];
+    v4sf best = -INFINITY;
+    for (int i = 0; i < sl->size; i++)
+    {
+        int id = sl->candidates[i];
+        v4sf val = 0.0f;
+        dsps_dotprod_f32_aes3(&w->wcls[(size_t)id * p->dim], x, &val, p->dim);
+        sl->exact[i] = val;
+        best = val > best ? val : best;
+    }
+    if (best < left_out + sl->margin)
+    {
+        // the proxy may have missed the winner, compute every logit
+        matmul(t->pool, s->logits, x, w->wcls, p->dim, p->vocab_size);
+        sl->fallbacks++;
+        return;
+    }
+    for (int i = 0; i < p->vocab_size; i++)
+    {
+        s->logits[i] = -INFINITY;
+    }
+    for (int i = 0; i < sl->size; i++)
+    {
+        s->logits[sl->candidates[i]] = sl->exact[i];
+    }
+    sl->hits++;
+}
+
+void matmul_batch(WorkerPool *pool, v4sf *xout, v4sf *x, v4sf *w, int n, int d, int batch)
+{
+    // W (d,n) @ x (batch,n) -> xout (batch,d). every row of W is read once for
+    // the whole batch, which is what makes verifying several tokens cheap
+    pool->matmul = (MatMulTaskParams){xout, x, w, d / 2, d, n, d, .batch = batch};
+    xSemaphoreGive(pool->matmul_start);
+    for (int i = 0; i < d / 2; i++)
+    {
+        v4sf *row = &w[i * n];
+        for (int b = 0; b < batch; b++)
+        {
+            v4sf val = 0.0f;
+            dsps_dotprod_f32_aes3(row, x + b * n, &val, n);
+            xout[b * d + i] = val;
+        }
+    }
+    matmul_join(pool);
+}
+
+void project_batch(WorkerPool *pool, RunState *s, v4sf *xout, v4sf *x, LayerWeights *lw, int tensor, int n, int d, int batch)
+{
+    // project() for a batch of vectors, laid out like matmul_batch()
+    if (lw->lowrank[tensor] || lw->sparse[tensor])
+    {
+        for (int b = 0; b < batch; b++)
+        {
+            project(pool, s, xout + b * d, x + b * n, lw, tensor, n, d);
+        }
+    }
+    else
+    {
+        matmul_batch(pool, xout, x, lw->w[tensor], n, d, batch);
+    }
+}
+
+void rope(v4sf *q, v4sf *k, int pos, int dim, int kv_dim, int head_size)
+{
+    // RoPE relative positional encoding: complex-valued rotate q and k in each head
+    for (int i = 0; i < dim; i += 2)
+    {
+        int head_dim = i % head_size;
+        v4sf freq = 1.0f / powf(10000.0f, head_dim / (v4sf)head_size);
+        v4sf val = pos * freq;
+        v4sf fcr = cosf(val);
+        v4sf fci = sinf(val);
+        int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
+        for (int v = 0; v < rotn; v++)
+        {
+            v4sf *vec = v == 0 ? q : k; // the vector to rotate (query or key)
+            v4sf v0 = vec[i];
+            v4sf v1 = vec[i + 1];
+            vec[i] = v0 * fcr - v1 * fci;
+            vec[i + 1] = v0 * fci + v1 * fcr;
+        }
+    }
+}
+
+void attention(Transformer *transformer, v4sf *q, v4sf *xb, int pos, int loff)
+{
+    // multihead attention of one position over the kv cache up to pos,
+    // the second half of the heads runs on the forward task
+    Config *p = &transformer->config;
+    RunState *s = &transformer->state;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int head_size = dim / p->n_heads;
+    WorkerPool *pool = transformer->pool;
+    // start task
+    pool->forward = (ForwardTaskParams){
+        .s = s,
+        .w = &transformer->weights,
+        .p = p,
+        .q = q,
+        .xb = xb,
+        .pos = pos,
+        .start = p->n_heads / 2,
+        .loff = loff,
+        .end = p->n_heads,
+        .dim = dim,
+        .kv_dim = kv_dim,
+        .kv_mul = kv_mul,
+        .hidden_dim = p->hidden_dim,
+        .head_size = head_size,
+    };
+    xSemaphoreGive(pool->forward_start);
+
+    // multihead attention. iterate over all heads
+    int h;
+    // #pragma omp parallel for private(h)
+    for (h = 0; h < (p->n_heads / 2); h++)
+    {
+        // get the query vector for this head
+        v4sf *qh = q + h * head_size;
+        // attention scores for this head
+        v4sf *att = s->att + h * p->seq_len;
+        // iterate over all timesteps, including the current one
+        for (int t = 0; t <= pos; t++)
+        {
+            // get the key vector for this head and at this timestep
+            v4sf *k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
+            // calculate the attention score as the dot product of q and k
+            v4sf score = 0.0f;
+            for (int i = 0; i < head_size; i++)
+            {
+                score += qh[i] * k[i];
+            }
+            score /= sqrtf(head_size);
+            // save the score to the attention buffer
+            att[t] = score;
+        }
+
+        // softmax the scores to get attention weights, from 0..pos inclusively
+        softmax(att, pos + 1);
+
+        // weighted sum of the values, store back into xb
+        v4sf *xbh = xb + h * head_size;
+        memset(xbh, 0, head_size * sizeof(v4sf));
+        for (int t = 0; t <= pos; t++)
+        {
+            // get the value vector for this head and at this timestep
+            v4sf *v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
+            // get the attention weight for this timestep
+            v4sf a = att[t];
+            // accumulate the weighted value into xb
+            for (int i = 0; i < head_size; i++)
+            {
+                xbh[i] += a * v[i];
+            }
+        }
+    }
+    uint32_t start = PROFILE_CLOCK();
+    xSemaphoreTake(pool->forward_done, portMAX_DELAY);
+    PROFILE_ADD(pool->wait_cycles, start);
+}
+
+static inline void profile_lap(Transformer *t, int layer, ProfileOp op)
+{
+    // charges the op that just ended along with the second core's part in it
+    profile_mark(t->profile, layer, op, t->pool->wait_cycles, t->pool->worker_cycles);
+    t->pool->wait_cycles = 0;
+    t->pool->worker_cycles = 0;
+}
+
+v4sf *forward_layers(Transformer *transformer, int token, int pos)
+{
+    // runs every layer for the token, filling the kv cache at pos, and returns
+    // the final normalized activation that the classifier turns into logits
+    HOT_LOGD("ram available: %lu", esp_get_free_heap_size());
+
+    // a few convenience variables
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    v4sf *x = s->x;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim = p->hidden_dim;
+    int head_size = dim / p->n_heads;
+
+    // copy the token embedding into x
+    v4sf *content_row = w->token_embedding_table + token * dim;
+    HOT_LOGD("Content row: %f", *content_row);
+    memcpy(x, content_row, dim * sizeof(*x));
+    PROFILE_START(transformer);
+
+    // forward all the layers
+    for (unsigned long long l = 0; l < p->n_layers; l++)
+    {
+        LayerWeights lw;
+        get_layer_weights(transformer, l, &lw);
+        PROFILE_MARK(transformer, l, PROF_LOAD);
+        HOT_LOGD("X: %f, Weights %f", *x, *w->rms_att_weight);
+        // attention rmsnorm
+        rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+        PROFILE_MARK(transformer, l, PROF_RMSNORM);
+
+        // key and value point to the kv cache
+        int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
+        s->k = s->key_cache + loff + pos * kv_dim;
+        s->v = s->value_cache + loff + pos * kv_dim;
+
+        // qkv matmuls for this position
+        project(transformer->pool, s, s->q, s->xb, &lw, TENSOR_WQ, dim, dim);
+        PROFILE_MARK(transformer, l, PROF_WQ);
+        project(transformer->pool, s, s->k, s->xb, &lw, TENSOR_WK, dim, kv_dim);
+        PROFILE_MARK(transformer, l, PROF_WK);
+        project(transformer->pool, s, s->v, s->xb, &lw, TENSOR_WV, dim, kv_dim);
+        PROFILE_MARK(transformer, l, PROF_WV);
+
+        rope(s->q, s->k, pos, dim, kv_dim, head_size);
+        PROFILE_MARK(transformer, l, PROF_ROPE);
+        attention(transformer, s->q, s->xb, pos, loff);
+        PROFILE_MARK(transformer, l, PROF_ATTENTION);
+
+        // final matmul to get the output of the attention
+        project(transformer->pool, s, s->xb2, s->xb, &lw, TENSOR_WO, dim, dim);
+        PROFILE_MARK(transformer, l, PROF_WO);
+
+        // residual connection back into x
+        for (int i = 0; i < dim; i++)
+        {
+            x[i] += s->xb2[i];
+        }
+        PROFILE_MARK(transformer, l, PROF_RESIDUAL);
+
+        // ffn rmsnorm
+        rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+        PROFILE_MARK(transformer, l, PROF_RMSNORM);
+
+        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+        // first calculate self.w1(x) and self.w3(x)
+        project(transformer->pool, s, s->hb, s->xb, &lw, TENSOR_W1, dim, hidden_dim);
+        PROFILE_MARK(transformer, l, PROF_W1);
+        project(transformer->pool, s, s->hb2, s->xb, &lw, TENSOR_W3, dim, hidden_dim);
+        PROFILE_MARK(transformer, l, PROF_W3);
+
+        // SwiGLU non-linearity
+        for (int i = 0; i < hidden_dim; i++)
+        {
+            v4sf val = s->hb[i];
+            // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+            val *= (1.0f / (1.0f + expf(-val)));
+            // elementwise multiply with w3(x)
+            val *= s->hb2[i];
+            s->hb[i] = val;
+        }
+        PROFILE_MARK(transformer, l, PROF_SWIGLU);
+
+        // final matmul to get the output of the ffn
+        project(transformer->pool, s, s->xb, s->hb, &lw, TENSOR_W2, hidden_dim, dim);
+        PROFILE_MARK(transformer, l, PROF_W2);
+
+        // residual connection
+        for (int i = 0; i < dim; i++)
+        {
+            x[i] += s->xb[i];
+        }
+        PROFILE_MARK(transformer, l, PROF_RESIDUAL);
+    }
+
+    // final rmsnorm
+    rmsnorm(x, x, w->rms_final_weight, dim);
+    PROFILE_MARK(transformer, p->n_layers, PROF_RMSNORM);
+    return x;
+}
+
+void classify(Transformer *transformer, v4sf *x)
+{
+    // classifier into logits
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    LowRankMatrix *cls = &w->lowrank[p->n_layers * LAYER_TENSORS];
+    if (transformer->shortlist.size > 0)
+    {
+        classify_shortlist(transformer, x);
+    }
+    else if (cls->rank != 0)
+    {
+        lowrank_matmul(transformer->pool, s->logits, x, cls, s->lowrank);
+    }
+    else
+    {
+        matmul(transformer->pool, s->logits, x, w->wcls, p->dim, p->vocab_size);
+    }
+}
+
+v4sf *forward(Transformer *transformer, int token, int pos)
+{
+    v4sf *x = forward_layers(transformer, token, pos);
+    classify(transformer, x);
+    PROFILE_MARK(transformer, transformer->config.n_layers, PROF_CLASSIFIER);
+    return transformer->state.logits;
+}
+
+v4sf *forward_batch(Transformer *transformer, int *tokens, int n, int pos)
+{
+    // forward() for n consecutive tokens at positions pos..pos+n-1, returning
+    // their logits (n, vocab_size). each layer's weights are read once for
+    // the whole batch instead of once per token
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim = p->hidden_dim;
+    int head_size = dim / p->n_heads;
+
+    for (int b = 0; b < n; b++)
+    {
+        memcpy(s->bx + b * dim, w->token_embedding_table + tokens[b] * dim, dim * sizeof(v4sf));
+    }
+    PROFILE_START(transformer);
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        LayerWeights lw;
+        get_layer_weights(transformer, l, &lw);
+        PROFILE_MARK(transformer, l, PROF_LOAD);
+        for (int b = 0; b < n; b++)
+        {
+            rmsnorm(s->bxb + b * dim, s->bx + b * dim, w->rms_att_weight + l * dim, dim);
+        }
+        PROFILE_MARK(transformer, l, PROF_RMSNORM);
+
+        // the keys and values of consecutive positions are contiguous in the kv cache
+        int loff = l * p->seq_len * kv_dim;
+        v4sf *k = s->key_cache + loff + pos * kv_dim;
+        v4sf *v = s->value_cache + loff + pos * kv_dim;
+        project_batch(transformer->pool, s, s->bq, s->bxb, &lw, TENSOR_WQ, dim, dim, n);
+        PROFILE_MARK(transformer, l, PROF_WQ);
+        project_batch(transformer->pool, s, k, s->bxb, &lw, TENSOR_WK, dim, kv_dim, n);
+        PROFILE_MARK(transformer, l, PROF_WK);
+        project_batch(transformer->pool, s, v, s->bxb, &lw, TENSOR_WV, dim, kv_dim, n);
+        PROFILE_MARK(transformer, l, PROF_WV);
+
+        // causal: each position only sees the keys up to its own
+        for (int b = 0; b < n; b++)
+        {
+            rope(s->bq + b * dim, k + b * kv_dim, pos + b, dim, kv_dim, head_size);
+            PROFILE_MARK(transformer, l, PROF_ROPE);
+            attention(transformer, s->bq + b * dim, s->bxb + b * dim, pos + b, loff);
+            PROFILE_MARK(transformer, l, PROF_ATTENTION);
+        }
+
+        project_batch(transformer->pool, s, s->bxb2, s->bxb, &lw, TENSOR_WO, dim, dim, n);
+        PROFILE_MARK(transformer, l, PROF_WO);
+        for (int i = 0; i < n * dim; i++)
+        {
+            s->bx[i] += s->bxb2[i];
         }
-    }
-}
+        PROFILE_MARK(transformer, l, PROF_RESIDUAL);
 
-void matmul(v4sf *xout, v4sf *x, v4sf *w, int n, int d)
-{
+        for (int b = 0; b < n; b++)
+        {
+            rmsnorm(s->bxb + b * dim, s->bx + b * dim, w->rms_ffn_weight + l * dim, dim);
+        }
+        PROFILE_MARK(transformer, l, PROF_RMSNORM);
+        project_batch(transformer->pool, s, s->bhb, s->bxb, &lw, TENSOR_W1, dim, hidden_dim, n);
+        PROFILE_MARK(transformer, l, PROF_W1);
+        project_batch(transformer->pool, s, s->bhb2, s->bxb, &lw, TENSOR_W3, dim, hidden_dim, n);
+        PROFILE_MARK(transformer, l, PROF_W3);
+        for (int i = 0; i < n * hidden_dim; i++)
+        {
+            v4sf val = s->bhb[i];
+            val *= (1.0f / (1.0f + expf(-val)));
+            val *= s->bhb2[i];
+            s->bhb[i] = val;
+        }
+        PROFILE_MARK(transformer, l, PROF_SWIGLU);
+        project_batch(transformer->pool, s, s->bxb, s->bhb, &lw, TENSOR_W2, hidden_dim, dim, n);
+        PROFILE_MARK(transformer, l, PROF_W2);
+        for (int i = 0; i < n * dim; i++)
+        {
+            s->bx[i] += s->bxb[i];
+        }
+        PROFILE_MARK(transformer, l, PROF_RESIDUAL);
+    }
 
-    // d is the number of rows
-    // n is the number of columns
-    // d X n
-    *matmul_params = (MatMulTaskParams){xout, x, w, d / 2, d, n, d, TASK_1_BIT};
-    xSemaphoreGive(semaDataReady);
-    for (int i = 0; i < d / 2; i++)
+    for (int b = 0; b < n; b++)
     {
-        v4sf val = 0.0f;
-        v4sf *row = &w[i * n]; // Pointer to the start of the current row in matrix w
-        dsps_dotprod_f32_aes3(row, x, &val, n);
-        xout[i] = val;
+        rmsnorm(s->bx + b * dim, s->bx + b * dim, w->rms_final_weight, dim);
     }
-    if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
+    PROFILE_MARK(transformer, p->n_layers, PROF_RMSNORM);
+    if (transformer->shortlist.size > 0 || w->lowrank[p->n_layers * LAYER_TENSORS].rank != 0)
     {
-        xEventGroupSync(xEventGroup,
-                        TASK_0_BIT,
-                        ALL_SYNC_BITS,
-                        portMAX_DELAY);
-
-        xEventGroupClearBits(xEventGroup, ALL_SYNC_BITS);
+        for (int b = 0; b < n; b++)
+        {
+            classify(transformer, s->bx + b * dim);
+            memcpy(s->blogits + b * p->vocab_size, s->logits, p->vocab_size * sizeof(v4sf));
+        }
+    }
+    else
+    {
+        matmul_batch(transformer->pool, s->blogits, s->bx, w->wcls, dim, p->vocab_size, n);
     }
-    //   ESP_LOGI(TAG, "Completed MatMul tasks");
+    PROFILE_MARK(transformer, p->n_layers, PROF_CLASSIFIER);
+    return s->blogits;
 }
 
-v4sf *forward(Transformer *transformer, int token, int pos)
+int forward_argmax(Transformer *transformer, Sampler *sampler, int token, int pos)
 {
-    ESP_LOGD(TAG, "ram available: %lu", esp_get_free_heap_size());
-
-    // a few convenience variables
+    // greedy decoding: the classifier is fused with the argmax so the logits
+    // are never written out. approximate classifiers still need them
     Config *p = &transformer->config;
     TransformerWeights *w = &transformer->weights;
-    RunState *s = &transformer->state;
-    v4sf *x = s->x;
-    int dim = p->dim;
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-    int hidden_dim = p->hidden_dim;
-    int head_size = dim / p->n_heads;
+    if (transformer->shortlist.size > 0 || w->lowrank[p->n_layers * LAYER_TENSORS].rank != 0)
+    {
+        v4sf *logits = forward(transformer, token, pos);
+        apply_penalties(sampler, logits);
+        return sample_argmax(logits, p->vocab_size);
+    }
+    v4sf *x = forward_layers(transformer, token, pos);
+    // penalized tokens are left out of the fused pass and scored here, there
+    // are at most penalty_window of them
+    const uint16_t *skip = sampler->n_unique > 0 ? sampler->counts : NULL;
+    v4sf best_val;
+    int best = matmul_argmax(transformer->pool, x, w->wcls, p->dim, p->vocab_size, skip, &best_val);
+    for (int i = 0; i < sampler->n_unique; i++)
+    {
+        int id = sampler->unique[i];
+        v4sf val = 0.0f;
+        dsps_dotprod_f32_aes3(&w->wcls[(size_t)id * p->dim], x, &val, p->dim);
+        val = penalize(sampler, id, val);
+        if (val > best_val || (val == best_val && id < best))
+        {
+            best = id;
+            best_val = val;
+        }
+    }
+    PROFILE_MARK(transformer, p->n_layers, PROF_CLASSIFIER);
+    return best;
+}
 
-    // copy the token embedding into x
-    v4sf *content_row = w->token_embedding_table + token * dim;
-    ESP_LOGD(TAG, "Content row: %f", *content_row);
-    memcpy(x, content_row, dim * sizeof(*x));
+// ----------------------------------------------------------------------------
+// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
 
-    // forward all the layers
-    for (unsigned long long l = 0; l < p->n_layers; l++)
-    {
-        ESP_LOGD(TAG, "X: %f, Weights %f", *x, *w->rms_att_weight);
-        // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+static inline const char *token_piece(Tokenizer *t, int id)
+{
+    return t->pieces + t->offsets[id];
+}
 
-        // key and value point to the kv cache
-        int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        s->k = s->key_cache + loff + pos * kv_dim;
-        s->v = s->value_cache + loff + pos * kv_dim;
+int compare_tokens(const void *a, const void *b)
+{
+    // ties on duplicate strings go to the lower id, so the image tool and the
+    // legacy loader put the same token in the trie
+    int order = strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+    return order != 0 ? order : ((TokenIndex *)a)->id - ((TokenIndex *)b)->id;
+}
 
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l * dim * dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l * dim * kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l * dim * kv_dim, dim, kv_dim);
-
-        // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i += 2)
-        {
-            int head_dim = i % head_size;
-            v4sf freq = 1.0f / powf(10000.0f, head_dim / (v4sf)head_size);
-            v4sf val = pos * freq;
-            v4sf fcr = cosf(val);
-            v4sf fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++)
-            {
-                v4sf *vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                v4sf v0 = vec[i];
-                v4sf v1 = vec[i + 1];
-                vec[i] = v0 * fcr - v1 * fci;
-                vec[i + 1] = v0 * fci + v1 * fcr;
-            }
+static inline int trie_find(Tokenizer *t, uint32_t node, unsigned char byte)
+{
+    // the child of node along byte, or -1. the children are consecutive and
+    // sorted, a binary search over at most 256 of them
+    uint32_t lo = t->trie_child[node];
+    uint32_t hi = t->trie_child[node + 1];
+    uint32_t end = hi;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (t->trie_byte[mid] < byte)
+        {
+            lo = mid + 1;
         }
-        // start task
-        *forward_params = (ForwardTaskParams){
-            .s = s,
-            .w = w,
-            .p = p,
-            .pos = pos,
-            .start = p->n_heads / 2,
-            .loff = loff,
-            .end = p->n_heads,
-            .dim = dim,
-            .kv_dim = kv_dim,
-            .kv_mul = kv_mul,
-            .hidden_dim = hidden_dim,
-            .head_size = head_size,
-            .task_num = FORWARD_TASK_1,
-        };
-        xSemaphoreGive(semaForwardDataReady);
-
-        // multihead attention. iterate over all heads
-        int h;
-        // #pragma omp parallel for private(h)
-        for (h = 0; h < (p->n_heads / 2); h++)
-        {
-            // get the query vector for this head
-            v4sf *q = s->q + h * head_size;
-            // attention scores for this head
-            v4sf *att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the key vector for this head and at this timestep
-                v4sf *k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // calculate the attention score as the dot product of q and k
-                v4sf score = 0.0f;
-                for (int i = 0; i < head_size; i++)
-                {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < end && t->trie_byte[lo] == byte ? (int)lo : -1;
+}
 
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
+int str_lookup(Tokenizer *t, const char *str)
+{
+    // find the perfect match for str in vocab, return its index or -1 if not found.
+    // one trie step per byte, a duplicate string finds its lowest id
+    uint32_t node = 0;
+    for (; *str != '\0'; str++)
+    {
+        int child = trie_find(t, node, *str);
+        if (child < 0)
+        {
+            return -1;
+        }
+        node = child;
+    }
+    return t->trie_token[node] != TRIE_NO_TOKEN ? t->trie_token[node] : -1;
+}
 
-            // weighted sum of the values, store back into xb
-            v4sf *xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(v4sf));
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the value vector for this head and at this timestep
-                v4sf *v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // get the attention weight for this timestep
-                v4sf a = att[t];
-                // accumulate the weighted value into xb
-                for (int i = 0; i < head_size; i++)
-                {
-                    xb[i] += a * v[i];
-                }
-            }
+int str_prefix_lookup(Tokenizer *t, const char *str, int *len)
+{
+    // the longest token str starts with, and its length in *len. -1 if no token
+    // is a prefix of str, for greedy longest match tokenization
+    int best = -1;
+    uint32_t node = 0;
+    for (int i = 0; str[i] != '\0'; i++)
+    {
+        int child = trie_find(t, node, str[i]);
+        if (child < 0)
+        {
+            break;
         }
-        if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
+        node = child;
+        if (t->trie_token[node] != TRIE_NO_TOKEN)
         {
+            best = t->trie_token[node];
+            *len = i + 1;
+        }
+    }
+    return best;
+}
 
-            xEventGroupSync(ForwardEventGroup,
-                            FORWARD_TASK_2,
-                            ALL_FORWARD_TASKS,
-                            portMAX_DELAY);
+static inline uint32_t merge_hash(uint32_t pair)
+{
+    pair *= 2654435761u; // Knuth's multiplicative hash, mixed down so the mask keeps the good bits
+    return pair ^ (pair >> 16);
+}
 
-            xEventGroupClearBits(ForwardEventGroup, ALL_FORWARD_TASKS);
+int merge_lookup(Tokenizer *t, int left, int right)
+{
+    // the token the pair (left, right) merges into, or -1 if it isn't in vocab
+    uint32_t pair = (uint32_t)left << 16 | (uint32_t)right;
+    for (uint32_t i = merge_hash(pair) & t->merge_mask;; i = (i + 1) & t->merge_mask)
+    {
+        if (t->merges[i].id < 0 || t->merges[i].pair == pair)
+        {
+            return t->merges[i].id;
+        }
+    }
+}
 
-            // final matmul to get the output of the attention
-            matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim);
+uint32_t merge_slots(int n_merges)
+{
+    // keep the table at most half full. tools/pack_tokenizer.py sizes its table the same way
+    uint32_t slots = 16;
+    while (slots < 2 * (uint32_t)n_merges)
+    {
+        slots *= 2;
+    }
+    return slots;
+}
 
-            // residual connection back into x
-            for (int i = 0; i < dim; i++)
+int scan_merges(Tokenizer *t, size_t max_len, int insert)
+{
+    // every token that is the concatenation of two other tokens is a merge. split
+    // each token at every byte once here, so encode() looks pairs up by id instead
+    // of formatting and searching strings for every pair on every pass. counts the
+    // merges, and adds them to the table if insert is set
+    char *prefix = mem_malloc(max_len + 1, MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    if (!prefix)
+    {
+        ESP_LOGE(TAG, "malloc failed for the merge table");
+        exit(EXIT_FAILURE);
+    }
+    int n_merges = 0;
+    for (int id = 0; id < t->vocab_size; id++)
+    {
+        const char *str = token_piece(t, id);
+        size_t len = strlen(str);
+        // a duplicate string never comes out of a merge, str_lookup() finds the other one
+        if (len < 2 || str_lookup(t, str) != id)
+        {
+            continue;
+        }
+        for (size_t split = 1; split < len; split++)
+        {
+            memcpy(prefix, str, split);
+            prefix[split] = '\0';
+            int left = str_lookup(t, prefix);
+            int right = str_lookup(t, str + split);
+            if (left < 0 || right < 0)
+            {
+                continue;
+            }
+            n_merges++;
+            if (!insert)
             {
-                x[i] += s->xb2[i];
+                continue;
             }
+            uint32_t pair = (uint32_t)left << 16 | (uint32_t)right;
+            uint32_t i = merge_hash(pair) & t->merge_mask;
+            while (t->merges[i].id >= 0)
+            {
+                i = (i + 1) & t->merge_mask;
+            }
+            t->merges[i].pair = pair;
+            t->merges[i].id = id;
+        }
+    }
+    mem_free(prefix, MEM_SCRATCH);
+    return n_merges;
+}
+
+static inline size_t align4(size_t size)
+{
+    return (size + 3) & ~(size_t)3;
+}
 
-            // ffn rmsnorm
-            rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+size_t tokenizer_image_size(const TokenizerHeader *h)
+{
+    // header, scores, offsets, string pool, trie, merge table
+    return sizeof(TokenizerHeader) + (size_t)h->vocab_size * 2 * sizeof(uint32_t) + h->pool_size +
+           (h->trie_nodes + 1) * sizeof(uint32_t) + align4(h->trie_nodes * sizeof(uint16_t)) + align4(h->trie_nodes) +
+           (size_t)h->merge_slots * sizeof(MergeEntry);
+}
 
-            // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-            // first calculate self.w1(x) and self.w3(x)
-            matmul(s->hb, s->xb, w->w1 + l * dim * hidden_dim, dim, hidden_dim);
-            matmul(s->hb2, s->xb, w->w3 + l * dim * hidden_dim, dim, hidden_dim);
+void map_tokenizer(Tokenizer *t, void *image)
+{
+    // point the tables into the image, nothing is copied
+    TokenizerHeader *h = image;
+    char *ptr = (char *)image + sizeof(TokenizerHeader);
+    t->image = image;
+    t->vocab_size = h->vocab_size;
+    t->max_token_length = h->max_token_length;
+    t->vocab_scores = (v4sf *)ptr;
+    ptr += h->vocab_size * sizeof(v4sf);
+    t->offsets = (uint32_t *)ptr;
+    ptr += h->vocab_size * sizeof(uint32_t);
+    t->pieces = ptr;
+    ptr += h->pool_size;
+    t->trie_nodes = h->trie_nodes;
+    t->trie_child = (uint32_t *)ptr;
+    ptr += (h->trie_nodes + 1) * sizeof(uint32_t);
+    t->trie_token = (uint16_t *)ptr;
+    ptr += align4(h->trie_nodes * sizeof(uint16_t));
+    t->trie_byte = (uint8_t *)ptr;
+    ptr += align4(h->trie_nodes);
+    t->merges = (MergeEntry *)ptr;
+    t->merge_mask = h->merge_slots - 1;
+}
 
-            // SwiGLU non-linearity
-            for (int i = 0; i < hidden_dim; i++)
+int count_trie_nodes(TokenIndex *sorted, int n)
+{
+    // one node per distinct prefix, plus the root: each string in sorted order
+    // adds the bytes past what it shares with the previous one
+    int nodes = 1;
+    for (int i = 0; i < n; i++)
+    {
+        size_t shared = 0;
+        if (i > 0)
+        {
+            while (sorted[i].str[shared] != '\0' && sorted[i].str[shared] == sorted[i - 1].str[shared])
             {
-                v4sf val = s->hb[i];
-                // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-                val *= (1.0f / (1.0f + expf(-val)));
-                // elementwise multiply with w3(x)
-                val *= s->hb2[i];
-                s->hb[i] = val;
+                shared++;
             }
+        }
+        nodes += strlen(sorted[i].str) - shared;
+    }
+    return nodes;
+}
 
-            // final matmul to get the output of the ffn
-            matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim);
-
-            // residual connection
-            for (int i = 0; i < dim; i++)
+void build_trie(Tokenizer *t, TokenIndex *sorted, int n)
+{
+    // breadth first over the sorted strings: each node covers the range of
+    // strings that start with its prefix, its children split that range by the
+    // next byte. tools/pack_tokenizer.py builds the same trie
+    uint32_t *range = mem_malloc(t->trie_nodes * 2 * sizeof(uint32_t), MEM_SCRATCH, MEM_CAPS_DEFAULT); // first and last + 1 string of each node
+    uint16_t *depth = mem_malloc(t->trie_nodes * sizeof(uint16_t), MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    if (!range || !depth)
+    {
+        ESP_LOGE(TAG, "malloc failed for the tokenizer trie");
+        exit(EXIT_FAILURE);
+    }
+    int n_nodes = 1;
+    range[0] = 0;
+    range[1] = n;
+    depth[0] = 0;
+    t->trie_byte[0] = 0;
+    for (int node = 0; node < n_nodes; node++)
+    {
+        uint32_t lo = range[2 * node], hi = range[2 * node + 1];
+        int d = depth[node];
+        t->trie_child[node] = n_nodes;
+        // the string that ends here sorts first, and the lowest id first among duplicates
+        t->trie_token[node] = lo < hi && sorted[lo].str[d] == '\0' ? sorted[lo].id : TRIE_NO_TOKEN;
+        while (lo < hi && sorted[lo].str[d] == '\0')
+        {
+            lo++;
+        }
+        while (lo < hi)
+        {
+            unsigned char byte = sorted[lo].str[d];
+            uint32_t end = lo + 1;
+            while (end < hi && (unsigned char)sorted[end].str[d] == byte)
             {
-                x[i] += s->xb[i];
+                end++;
             }
+            t->trie_byte[n_nodes] = byte;
+            range[2 * n_nodes] = lo;
+            range[2 * n_nodes + 1] = end;
+            depth[n_nodes] = d + 1;
+            n_nodes++;
+            lo = end;
         }
     }
+    t->trie_child[n_nodes] = n_nodes;
+    mem_free(range, MEM_SCRATCH);
+    mem_free(depth, MEM_SCRATCH);
+}
 
-    // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
+void *resize_image(Tokenizer *t, void *image, TokenizerHeader *h)
+{
+    // grows the image for the tables h now has room for, and points t into it again
+    image = mem_realloc(image, tokenizer_image_size(h), MEM_TOKENIZER);
+    if (!image)
+    {
+        ESP_LOGE(TAG, "malloc failed for the tokenizer");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(image, h, sizeof(TokenizerHeader));
+    map_tokenizer(t, image);
+    return image;
+}
 
-    // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
-    return s->logits;
+void pack_tokenizer(Tokenizer *t, const char *file, size_t file_size, int vocab_size)
+{
+    // converts the llama2.c tokenizer format, (score, length, string) records,
+    // into the image layout in RAM. tools/pack_tokenizer.py does this ahead of
+    // time so boot skips the sort, the trie and the merge table
+    TokenizerHeader h = {TOKENIZER_MAGIC, TOKENIZER_VERSION, vocab_size, 0, 0, 0, 0};
+    const char *end = file + file_size;
+    const char *ptr = file + sizeof(int);
+    size_t max_len = 0;
+    for (int i = 0; i < vocab_size; i++)
+    {
+        int len = -1;
+        if (ptr + sizeof(v4sf) + sizeof(int) <= end)
+        {
+            memcpy(&len, ptr + sizeof(v4sf), sizeof(int));
+            ptr += sizeof(v4sf) + sizeof(int);
+        }
+        if (len < 0 || len > end - ptr)
+        {
+            ESP_LOGE(TAG, "failed read vocab, the tokenizer has fewer than %d tokens", vocab_size);
+            exit(EXIT_FAILURE);
+        }
+        ptr += len;
+        h.pool_size += len + 1;
+        max_len = (size_t)len > max_len ? (size_t)len : max_len;
+    }
+    memcpy(&h.max_token_length, file, sizeof(int));
+    h.pool_size = align4(h.pool_size);
+    // the strings go in first, the trie and the merge table are sized from them
+    void *image = mem_calloc(1, tokenizer_image_size(&h), MEM_TOKENIZER, MEM_CAPS_DEFAULT);
+    TokenIndex *sorted = mem_malloc(vocab_size * sizeof(TokenIndex), MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    if (!image || !sorted)
+    {
+        ESP_LOGE(TAG, "malloc failed for the tokenizer");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(image, &h, sizeof(h));
+    map_tokenizer(t, image);
+    char *pieces = (char *)t->pieces;
+    uint32_t offset = 0;
+    ptr = file + sizeof(int);
+    for (int i = 0; i < vocab_size; i++)
+    {
+        int len;
+        memcpy(&t->vocab_scores[i], ptr, sizeof(v4sf));
+        memcpy(&len, ptr + sizeof(v4sf), sizeof(int));
+        ptr += sizeof(v4sf) + sizeof(int);
+        t->offsets[i] = offset;
+        memcpy(pieces + offset, ptr, len); // calloc already terminated it
+        ptr += len;
+        offset += len + 1;
+        sorted[i].str = pieces + t->offsets[i];
+        sorted[i].id = i;
+    }
+    qsort(sorted, vocab_size, sizeof(TokenIndex), compare_tokens);
+    h.trie_nodes = count_trie_nodes(sorted, vocab_size);
+    image = resize_image(t, image, &h);
+    for (int i = 0; i < vocab_size; i++)
+    {
+        sorted[i].str = (char *)token_piece(t, sorted[i].id); // the pool moved with the image
+    }
+    build_trie(t, sorted, vocab_size);
+    mem_free(sorted, MEM_SCRATCH);
+    h.merge_slots = merge_slots(scan_merges(t, max_len, 0));
+    resize_image(t, image, &h);
+    memset(t->merges, 0xff, h.merge_slots * sizeof(MergeEntry)); // id -1, empty
+    int n_merges = scan_merges(t, max_len, 1);
+    ESP_LOGI(TAG, "Trie: %d nodes, merge table: %d merges in %u slots", h.trie_nodes, n_merges, (unsigned)h.merge_slots);
 }
 
-// ----------------------------------------------------------------------------
-// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
+static int printable_piece(const char *piece)
+{
+    // empty pieces and lone bytes that aren't printable or whitespace are never printed
+    if (piece[0] == '\0')
+    {
+        return 0;
+    }
+    if (piece[1] == '\0')
+    {
+        unsigned char byte_val = piece[0];
+        return isprint(byte_val) || isspace(byte_val);
+    }
+    return 1;
+}
 
-int compare_tokens(const void *a, const void *b)
+void build_decode_table(Tokenizer *t)
 {
-    return strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+    // decode() used to parse every generated token, do it once per token here
+    t->decode_table = mem_malloc(t->vocab_size * sizeof(DecodeEntry), MEM_TOKENIZER, MEM_CAPS_DEFAULT);
+    if (!t->decode_table)
+    {
+        ESP_LOGE(TAG, "malloc failed for the decode table");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < t->vocab_size; i++)
+    {
+        const char *piece = token_piece(t, i);
+        DecodeEntry *entry = &t->decode_table[i];
+        entry->offset = t->offsets[i];
+        entry->flags = 0;
+        // the stripped piece is used as is, sentencepiece has no space + byte tokens
+        if (piece[0] == ' ')
+        {
+            entry->flags |= DECODE_SPACE;
+            entry->flags |= printable_piece(piece + 1) ? DECODE_SPACE_PRINTABLE : 0;
+        }
+        // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
+        // parse this and convert and return the actual byte
+        unsigned char byte_val;
+        if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1)
+        {
+            entry->offset = byte_val;
+            entry->flags |= DECODE_BYTE;
+            piece = (char *)t->byte_pieces + byte_val * 2;
+        }
+        entry->len = strlen(piece);
+        entry->flags |= printable_piece(piece) ? DECODE_PRINTABLE : 0;
+    }
 }
 
 void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
 {
     // i should have written the vocab_size into the tokenizer file... sigh
     ESP_LOGI(TAG, "Vocab size is %d\n", vocab_size);
-    t->vocab_size = vocab_size;
-    // malloc space to hold the scores and the strings
-    t->vocab = (char **)malloc(vocab_size * sizeof(char *));
-    t->vocab_scores = (v4sf *)malloc(vocab_size * sizeof(v4sf));
-    t->sorted_vocab = NULL; // initialized lazily
+    int64_t load_start = esp_timer_get_time();
+    if (vocab_size > 0xffff)
+    {
+        ESP_LOGE(TAG, "vocab size %d doesn't fit the merge table", vocab_size);
+        exit(EXIT_FAILURE);
+    }
     for (int i = 0; i < 256; i++)
     {
         t->byte_pieces[i * 2] = (unsigned char)i;
         t->byte_pieces[i * 2 + 1] = '\0';
     }
-    // read in the file
+    // read in the file, in one go
     FILE *file = fopen(tokenizer_path, "rb");
     if (!file)
     {
@@ -611,121 +2200,205 @@ void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
         exit(EXIT_FAILURE);
     }
     ESP_LOGI(TAG, "Opened Tokenizer File");
-    if (fread(&t->max_token_length, sizeof(int), 1, file) != 1)
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = mem_malloc(file_size, MEM_TOKENIZER, MEM_CAPS_DEFAULT);
+    if (!data || file_size < sizeof(int) || fread(data, 1, file_size, file) != file_size)
     {
         ESP_LOGE(TAG, "failed read");
         exit(EXIT_FAILURE);
     }
-    int len;
-    for (int i = 0; i < vocab_size; i++)
+    fclose(file);
+    TokenizerHeader *h = (TokenizerHeader *)data;
+    if (file_size >= sizeof(TokenizerHeader) && h->magic == TOKENIZER_MAGIC)
     {
-        if (fread(t->vocab_scores + i, sizeof(v4sf), 1, file) != 1)
-        {
-            ESP_LOGE(TAG, "failed read vocab scores");
-            exit(EXIT_FAILURE);
-        }
-        if (fread(&len, sizeof(int), 1, file) != 1)
-        {
-            ESP_LOGE(TAG, "failed read len");
-            exit(EXIT_FAILURE);
-        }
-        t->vocab[i] = (char *)malloc(len + 1);
-        if (fread(t->vocab[i], len, 1, file) != 1)
+        // a prebuilt image is used in place, only the table pointers are set up
+        if (h->version != TOKENIZER_VERSION || h->vocab_size != vocab_size || h->trie_nodes == 0 ||
+            h->merge_slots == 0 || (h->merge_slots & (h->merge_slots - 1)) != 0 ||
+            tokenizer_image_size(h) > file_size)
         {
-            ESP_LOGE(TAG, "failed read vocab");
+            ESP_LOGE(TAG, "tokenizer image doesn't match the model, or is truncated");
             exit(EXIT_FAILURE);
         }
-        t->vocab[i][len] = '\0'; // add the string terminating token
+        map_tokenizer(t, data);
     }
-    fclose(file);
-    ESP_LOGI(TAG, "Tokenizer successfully built");
+    else
+    {
+        pack_tokenizer(t, data, file_size, vocab_size);
+        mem_free(data, MEM_TOKENIZER);
+    }
+    build_decode_table(t);
+    ESP_LOGI(TAG, "Tokenizer successfully built in %lld ms", (esp_timer_get_time() - load_start) / 1000);
 }
 
 void free_tokenizer(Tokenizer *t)
 {
-    for (int i = 0; i < t->vocab_size; i++)
-    {
-        free(t->vocab[i]);
-    }
-    free(t->vocab);
-    free(t->vocab_scores);
-    free(t->sorted_vocab);
+    mem_free(t->image, MEM_TOKENIZER);
+    mem_free(t->decode_table, MEM_TOKENIZER);
 }
 
-char *decode(Tokenizer *t, int prev_token, int token)
+char *decode(Tokenizer *t, int prev_token, int token, int *len, int *printable)
 {
-    char *piece = t->vocab[token];
+    // a table lookup, build_decode_table() did the parsing. sets the length of
+    // the piece and whether safe_printf() prints it
+    DecodeEntry entry = t->decode_table[token];
     // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
-    if (prev_token == 1 && piece[0] == ' ')
+    if (prev_token == 1 && (entry.flags & DECODE_SPACE))
     {
-        piece++;
+        *len = entry.len - 1;
+        *printable = (entry.flags & DECODE_SPACE_PRINTABLE) != 0;
+        return (char *)t->pieces + entry.offset + 1;
     }
-    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
-    // parse this and convert and return the actual byte
-    unsigned char byte_val;
-    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1)
+    *len = entry.len;
+    *printable = (entry.flags & DECODE_PRINTABLE) != 0;
+    if (entry.flags & DECODE_BYTE)
     {
-        piece = (char *)t->byte_pieces + byte_val * 2;
+        return (char *)t->byte_pieces + entry.offset * 2;
     }
-    return piece;
+    return (char *)t->pieces + entry.offset;
 }
 
-void safe_printf(char *piece)
+void safe_printf(char *piece, int len, int printable)
 {
     // piece might be a raw byte token, and we only want to print printable chars or whitespace
     // because some of the other bytes can be various control codes, backspace, etc.
-    if (piece == NULL)
+    if (printable)
     {
-        return;
+        console_write(piece, len);
     }
-    if (piece[0] == '\0')
+}
+
+static inline int merge_before(const MergeCandidate *a, const MergeCandidate *b)
+{
+    // the best score goes first, the leftmost pair on ties
+    return a->score > b->score || (a->score == b->score && a->left < b->left);
+}
+
+static void merge_push(Tokenizer *t, MergeCandidate *heap, int *n, int *tokens, int left, int right)
+{
+    int id = merge_lookup(t, tokens[left], tokens[right]);
+    if (id < 0 || !(t->vocab_scores[id] > -1e10f))
     {
         return;
     }
-    if (piece[1] == '\0')
+    MergeCandidate c = {t->vocab_scores[id], left, right, tokens[left], tokens[right], id};
+    int i = (*n)++;
+    while (i > 0 && merge_before(&c, &heap[(i - 1) / 2]))
     {
-        unsigned char byte_val = piece[0];
-        if (!(isprint(byte_val) || isspace(byte_val)))
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+}
+
+static MergeCandidate merge_pop(MergeCandidate *heap, int *n)
+{
+    MergeCandidate top = heap[0];
+    MergeCandidate last = heap[--(*n)];
+    int i = 0;
+    while (2 * i + 1 < *n)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < *n && merge_before(&heap[child + 1], &heap[child]))
+        {
+            child++;
+        }
+        if (!merge_before(&heap[child], &last))
         {
-            return; // bad byte, don't print it
+            break;
         }
+        heap[i] = heap[child];
+        i = child;
     }
-    printf("%s", piece);
+    heap[i] = last;
+    return top;
 }
 
-int str_lookup(char *str, TokenIndex *sorted_vocab, int vocab_size)
+void merge_pairs(Tokenizer *t, int *tokens, int *n_tokens, EncodeScratch *scratch)
 {
-    // efficiently find the perfect match for str in vocab, return its index or -1 if not found
-    TokenIndex tok = {.str = str}; // acts as the key to search for
-    TokenIndex *res = bsearch(&tok, sorted_vocab, vocab_size, sizeof(TokenIndex), compare_tokens);
-    return res != NULL ? res->id : -1;
+    // byte pair encoding over a linked list of the tokens: a heap holds every
+    // adjacent pair that merges, best first. a merge only changes the pairs on
+    // either side, those are pushed again and the stale ones are skipped when
+    // popped. O(n log n) instead of rescanning every pair after each merge
+    int n = *n_tokens;
+    if (n < 2)
+    {
+        return;
+    }
+    // each merge removes a token and pushes at most two pairs
+    EncodeScratch temp = {0};
+    if (scratch == NULL || scratch->capacity < n)
+    {
+        temp.capacity = n;
+        temp.links = mem_malloc(2 * n * sizeof(int), MEM_SCRATCH, MEM_CAPS_DEFAULT);
+        temp.heap = mem_malloc(3 * n * sizeof(MergeCandidate), MEM_SCRATCH, MEM_CAPS_DEFAULT);
+        if (!temp.links || !temp.heap)
+        {
+            ESP_LOGE(TAG, "malloc failed for %d tokens", n);
+            exit(EXIT_FAILURE);
+        }
+        scratch = &temp;
+    }
+    int *links = scratch->links;
+    MergeCandidate *heap = scratch->heap;
+    int *prev = links;
+    int *next = links + scratch->capacity;
+    int n_heap = 0;
+    for (int i = 0; i < n; i++)
+    {
+        prev[i] = i - 1;
+        next[i] = i + 1 < n ? i + 1 : -1;
+    }
+    for (int i = 0; i + 1 < n; i++)
+    {
+        merge_push(t, heap, &n_heap, tokens, i, i + 1);
+    }
+    while (n_heap > 0)
+    {
+        MergeCandidate c = merge_pop(heap, &n_heap);
+        if (next[c.left] != c.right || tokens[c.left] != c.left_id || tokens[c.right] != c.right_id)
+        {
+            continue; // a neighbour merged since this pair was pushed
+        }
+        // merge the consecutive pair into the left token, unlink the right one
+        tokens[c.left] = c.id;
+        tokens[c.right] = -1;
+        next[c.left] = next[c.right];
+        if (next[c.left] >= 0)
+        {
+            prev[next[c.left]] = c.left;
+            merge_push(t, heap, &n_heap, tokens, c.left, next[c.left]);
+        }
+        if (prev[c.left] >= 0)
+        {
+            merge_push(t, heap, &n_heap, tokens, prev[c.left], c.left);
+        }
+    }
+    // the first token is never unlinked, compact the list back into tokens
+    int count = 0;
+    for (int i = 0; i >= 0; i = next[i])
+    {
+        tokens[count++] = tokens[i];
+    }
+    *n_tokens = count;
+    mem_free(temp.links, MEM_SCRATCH);
+    mem_free(temp.heap, MEM_SCRATCH);
 }
 
-void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens)
+void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens, EncodeScratch *scratch)
 {
     // encode the string text (input) into an upper-bound preallocated tokens[] array
     // bos != 0 means prepend the BOS token (=1), eos != 0 means append the EOS token (=2)
+    // scratch holds the merge state for up to scratch->capacity tokens, NULL allocates it
     if (text == NULL)
     {
         ESP_LOGE(TAG, "cannot encode NULL text");
         exit(EXIT_FAILURE);
     }
 
-    if (t->sorted_vocab == NULL)
-    {
-        // lazily malloc and sort the vocabulary
-        t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
-        for (int i = 0; i < t->vocab_size; i++)
-        {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
-    }
-
-    // create a temporary buffer that will store merge candidates of always two consecutive tokens
-    // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_length is 1)
-    char *str_buffer = malloc((t->max_token_length * 2 + 1 + 2) * sizeof(char));
+    // a buffer for the current UTF-8 codepoint, at most 4 bytes and the null terminator
+    char str_buffer[5];
     size_t str_len = 0;
 
     // start at 0 tokens
@@ -741,7 +2414,7 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     // energy to read more of the sentencepiece code to figure out what it's doing
     if (text[0] != '\0')
     {
-        int dummy_prefix = str_lookup(" ", t->sorted_vocab, t->vocab_size);
+        int dummy_prefix = str_lookup(t, " ");
         tokens[(*n_tokens)++] = dummy_prefix;
     }
 
@@ -781,7 +2454,7 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
         }
 
         // ok c+1 is not a continuation byte, so we've read in a full codepoint
-        int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
+        int id = str_lookup(t, str_buffer);
 
         if (id != -1)
         {
@@ -802,46 +2475,11 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     }
 
     // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1)
-    {
-        v4sf best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
-
-        for (int i = 0; i < (*n_tokens - 1); i++)
-        {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            sprintf(str_buffer, "%s%s", t->vocab[tokens[i]], t->vocab[tokens[i + 1]]);
-            int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
-            if (id != -1 && t->vocab_scores[id] > best_score)
-            {
-                // this merge pair exists in vocab! record its score and position
-                best_score = t->vocab_scores[id];
-                best_id = id;
-                best_idx = i;
-            }
-        }
-
-        if (best_idx == -1)
-        {
-            break; // we couldn't find any more pairs to merge, so we're done
-        }
-
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx + 1; i < (*n_tokens - 1); i++)
-        {
-            tokens[i] = tokens[i + 1];
-        }
-        (*n_tokens)--; // token length decreased
-    }
+    merge_pairs(t, tokens, n_tokens, scratch);
 
     // add optional EOS (=2) token, if desired
     if (eos)
         tokens[(*n_tokens)++] = 2;
-
-    free(str_buffer);
 }
 
 // ----------------------------------------------------------------------------
@@ -880,65 +2518,234 @@ int sample_mult(v4sf *probabilities, int n, v4sf coin)
     return n - 1; // in case of rounding errors
 }
 
-int compare(const void *a, const void *b)
+void swap_candidates(ProbIndex *a, ProbIndex *b)
 {
-    ProbIndex *a_ = (ProbIndex *)a;
-    ProbIndex *b_ = (ProbIndex *)b;
-    if (a_->prob > b_->prob)
-        return -1;
-    if (a_->prob < b_->prob)
-        return 1;
-    return 0;
+    ProbIndex tmp = *a;
+    *a = *b;
+    *b = tmp;
 }
 
-int sample_topp(v4sf *probabilities, int n, v4sf topp, ProbIndex *probindex, v4sf coin)
+void select_top(ProbIndex *candidates, int n, int k)
 {
-    // top-p sampling (or "nucleus sampling") samples from the smallest set of
-    // tokens that exceed probability topp. This way we never sample tokens that
-    // have very low probabilities and are less likely to go "off the rails".
-    // coin is a random number in [0, 1), usually from random_f32()
+    // quickselect: moves the k most likely candidates to the front, in no
+    // particular order. O(n) on average where sorting would be O(n log n)
+    int lo = 0;
+    int hi = n - 1;
+    while (lo < hi)
+    {
+        v4sf pivot = candidates[(lo + hi) / 2].prob;
+        int i = lo;
+        int j = hi;
+        while (i <= j)
+        {
+            while (candidates[i].prob > pivot)
+                i++;
+            while (candidates[j].prob < pivot)
+                j--;
+            if (i <= j)
+            {
+                swap_candidates(&candidates[i++], &candidates[j--]);
+            }
+        }
+        // [lo, j] >= pivot >= [i, hi], anything in between equals the pivot
+        if (k - 1 <= j)
+            hi = j;
+        else if (k - 1 >= i)
+            lo = i;
+        else
+            break;
+    }
+}
 
-    int n0 = 0;
-    // quicksort indices in descending order of probabilities
-    // values smaller than (1 - topp) / (n - 1) cannot be part of the result
-    // so for efficiency we crop these out as candidates before sorting
-    const v4sf cutoff = (1.0f - topp) / (n - 1);
-    for (int i = 0; i < n; i++)
+void sift_down(ProbIndex *heap, int n, int i)
+{
+    // restores the max-heap property below i
+    for (;;)
+    {
+        int largest = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && heap[l].prob > heap[largest].prob)
+            largest = l;
+        if (r < n && heap[r].prob > heap[largest].prob)
+            largest = r;
+        if (largest == i)
+            return;
+        swap_candidates(&heap[i], &heap[largest]);
+        i = largest;
+    }
+}
+
+v4sf softmax_candidates(ProbIndex *candidates, int n, v4sf temperature)
+{
+    // exp((logit - max) / temperature) in place, returns the sum so callers
+    // can normalize lazily. the esp-dsp kernels step over the interleaved indices
+    v4sf max_val = candidates[0].prob;
+    for (int i = 1; i < n; i++)
     {
-        if (probabilities[i] >= cutoff)
+        if (candidates[i].prob > max_val)
         {
-            probindex[n0].index = i;
-            probindex[n0].prob = probabilities[i];
-            n0++;
+            max_val = candidates[i].prob;
         }
     }
-    qsort(probindex, n0, sizeof(ProbIndex), compare);
+    const int stride = sizeof(ProbIndex) / sizeof(v4sf);
+    dsps_addc_f32(&candidates->prob, &candidates->prob, n, -max_val, stride, stride);
+    dsps_mulc_f32(&candidates->prob, &candidates->prob, n, 1.0f / temperature, stride, stride);
+    v4sf sum = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        candidates[i].prob = expf(candidates[i].prob);
+        sum += candidates[i].prob;
+    }
+    return sum;
+}
 
-    // truncate the list where cumulative probability exceeds topp
-    v4sf cumulative_prob = 0.0f;
-    int last_idx = n0 - 1; // in case of rounding errors consider all elements
-    for (int i = 0; i < n0; i++)
+int nucleus(ProbIndex *candidates, int n, v4sf total, v4sf topp, v4sf *cumulative_prob)
+{
+    // the smallest set of most likely tokens whose (unnormalized, summing to
+    // total) probability exceeds topp. it is usually a handful of tokens, so
+    // rather than sorting every candidate, heapify them and pop the most likely
+    // ones to the back until the cumulative probability exceeds topp.
+    // returns first, the nucleus being candidates[first, n), most likely last
+    for (int i = n / 2 - 1; i >= 0; i--)
+    {
+        sift_down(candidates, n, i);
+    }
+    *cumulative_prob = 0.0f;
+    int first = n;
+    while (first > 0)
     {
-        cumulative_prob += probindex[i].prob;
-        if (cumulative_prob > topp)
+        first--;
+        swap_candidates(&candidates[0], &candidates[first]);
+        sift_down(candidates, first, 0);
+        *cumulative_prob += candidates[first].prob;
+        if (*cumulative_prob > topp * total)
         {
-            last_idx = i;
-            break; // we've exceeded topp by including last_idx
+            break; // we've exceeded topp by including candidates[first]
         }
     }
+    return first;
+}
+
+int sample_topp(ProbIndex *candidates, int n, v4sf total, v4sf topp, v4sf coin)
+{
+    // top-p sampling (or "nucleus sampling") samples from the smallest set of
+    // tokens that exceed probability topp. This way we never sample tokens that
+    // have very low probabilities and are less likely to go "off the rails".
+    // probabilities are unnormalized, summing to total
+    // coin is a random number in [0, 1), usually from random_f32()
+    v4sf cumulative_prob;
+    int first = nucleus(candidates, n, total, topp, &cumulative_prob);
 
     // sample from the truncated list
     v4sf r = coin * cumulative_prob;
     v4sf cdf = 0.0f;
-    for (int i = 0; i <= last_idx; i++)
+    for (int i = n - 1; i >= first; i--)
     {
-        cdf += probindex[i].prob;
+        cdf += candidates[i].prob;
         if (r < cdf)
         {
-            return probindex[i].index;
+            return candidates[i].index;
+        }
+    }
+    return candidates[first].index; // in case of rounding errors
+}
+
+v4sf penalize(Sampler *sampler, int token, v4sf logit)
+{
+    // the penalties for a token that occurs in the window
+    int count = sampler->counts[token];
+    logit = logit > 0 ? logit / sampler->repetition_penalty : logit * sampler->repetition_penalty;
+    return logit - sampler->presence_penalty - count * sampler->frequency_penalty;
+}
+
+void apply_penalties(Sampler *sampler, v4sf *logits)
+{
+    for (int i = 0; i < sampler->n_unique; i++)
+    {
+        int id = sampler->unique[i];
+        logits[id] = penalize(sampler, id, logits[id]);
+    }
+}
+
+void sampler_accept(Sampler *sampler, int token)
+{
+    // slides the penalty window over a token that entered the sequence.
+    // O(1): the token leaving the window is known from the ring buffer.
+    // BOS (=1) and EOS (=2) stay out of it, penalizing the prompt's BOS would
+    // keep the sequence from ending naturally
+    if (sampler->penalty_window == 0 || token == 1 || token == 2)
+    {
+        return;
+    }
+    if (sampler->history_len == sampler->penalty_window)
+    {
+        int old = sampler->history[sampler->history_head];
+        if (--sampler->counts[old] == 0)
+        {
+            // swap remove from the unique tokens
+            int last = sampler->unique[--sampler->n_unique];
+            sampler->unique[sampler->unique_slot[old]] = last;
+            sampler->unique_slot[last] = sampler->unique_slot[old];
         }
     }
-    return probindex[last_idx].index; // in case of rounding errors
+    else
+    {
+        sampler->history_len++;
+    }
+    sampler->history[sampler->history_head] = token;
+    sampler->history_head = (sampler->history_head + 1) % sampler->penalty_window;
+    if (sampler->counts[token]++ == 0)
+    {
+        sampler->unique_slot[token] = sampler->n_unique;
+        sampler->unique[sampler->n_unique++] = token;
+    }
+}
+
+void sampler_reset(Sampler *sampler)
+{
+    // forgets the penalty window, the counts of the tokens still in it are cleared one by one
+    for (int i = 0; i < sampler->n_unique; i++)
+    {
+        sampler->counts[sampler->unique[i]] = 0;
+    }
+    sampler->n_unique = 0;
+    sampler->history_len = 0;
+    sampler->history_head = 0;
+}
+
+void sampler_set_penalties(Sampler *sampler, float repetition, float presence, float frequency, int window)
+{
+    // penalizes the tokens generated (or prompted) in the last window tokens
+    mem_free(sampler->history, MEM_SAMPLER);
+    mem_free(sampler->counts, MEM_SAMPLER);
+    mem_free(sampler->unique, MEM_SAMPLER);
+    mem_free(sampler->unique_slot, MEM_SAMPLER);
+    sampler->history = NULL;
+    sampler->counts = NULL;
+    sampler->unique = NULL;
+    sampler->unique_slot = NULL;
+    sampler->n_unique = 0;
+    sampler->history_len = 0;
+    sampler->history_head = 0;
+    sampler->repetition_penalty = repetition;
+    sampler->presence_penalty = presence;
+    sampler->frequency_penalty = frequency;
+    sampler->penalty_window = window < UINT16_MAX ? window : UINT16_MAX;
+    if (sampler->penalty_window <= 0)
+    {
+        sampler->penalty_window = 0;
+        return;
+    }
+    sampler->history = mem_malloc(sampler->penalty_window * sizeof(int), MEM_SAMPLER, MEM_CAPS_DEFAULT);
+    sampler->unique = mem_malloc(sampler->penalty_window * sizeof(int), MEM_SAMPLER, MEM_CAPS_DEFAULT);
+    sampler->counts = mem_calloc(sampler->vocab_size, sizeof(uint16_t), MEM_SAMPLER, MEM_CAPS_DEFAULT);
+    sampler->unique_slot = mem_malloc(sampler->vocab_size * sizeof(uint16_t), MEM_SAMPLER, MEM_CAPS_DEFAULT);
+    if (!sampler->history || !sampler->unique || !sampler->counts || !sampler->unique_slot)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void build_sampler(Sampler *sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed)
@@ -946,16 +2753,26 @@ void build_sampler(Sampler *sampler, int vocab_size, float temperature, float to
     sampler->vocab_size = vocab_size;
     sampler->temperature = temperature;
     sampler->topp = topp;
+    sampler->topk = 0;
     sampler->rng_state = rng_seed;
+    sampler->history = NULL;
+    sampler->counts = NULL;
+    sampler->unique = NULL;
+    sampler->unique_slot = NULL;
+    sampler_set_penalties(sampler, 1.0f, 0.0f, 0.0f, 0);
     // buffer only used with nucleus sampling; may not need but it's ~small
-    sampler->probindex = malloc(sampler->vocab_size * sizeof(ProbIndex));
+    sampler->probindex = mem_malloc(sampler->vocab_size * sizeof(ProbIndex), MEM_SAMPLER, MEM_CAPS_DEFAULT);
     ESP_LOGI(TAG, "Sampler Successfully built");
     //printf("temp: %f, topp: %f\n", temperature, topp);
 }
 
 void free_sampler(Sampler *sampler)
 {
-    free(sampler->probindex);
+    mem_free(sampler->probindex, MEM_SAMPLER);
+    mem_free(sampler->history, MEM_SAMPLER);
+    mem_free(sampler->counts, MEM_SAMPLER);
+    mem_free(sampler->unique, MEM_SAMPLER);
+    mem_free(sampler->unique_slot, MEM_SAMPLER);
 }
 
 unsigned int random_u32(unsigned long long *state)
@@ -974,37 +2791,128 @@ v4sf random_f32(unsigned long long *state)
 int sample(Sampler *sampler, v4sf *logits)
 {
     // sample the token given the logits and some hyperparameters
-    int next;
-    //printf("temp: %f, topp: %f\n", sampler->temperature, sampler->topp);
-    // if (sampler->temperature == 0.0f)
-    // {
+    apply_penalties(sampler, logits);
+    if (sampler->temperature == 0.0f)
+    {
         // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, sampler->vocab_size);
-    // }
-    // else
-    // {
-    //     // apply the temperature to the logits
-    //     for (int q = 0; q < sampler->vocab_size; q++)
-    //     {
-    //         logits[q] /= sampler->temperature;
-    //     }
-    //     // apply softmax to the logits to get the probabilities for next token
-    //     softmax(logits, sampler->vocab_size);
-    //     // flip a (v4sf) coin (this is our source of entropy for sampling)
-    //     v4sf coin = random_f32(&sampler->rng_state);
-    //     // we sample from this distribution to get the next token
-    //     if (sampler->topp <= 0 || sampler->topp >= 1)
-    //     {
-    //         // simply sample from the predicted probability distribution
-    //         next = sample_mult(logits, sampler->vocab_size, coin);
-    //     }
-    //     else
-    //     {
-    //         // top-p (nucleus) sampling, clamping the least likely tokens to zero
-    //         next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
-    //     }
-    // }
-    return next;
+        return sample_argmax(logits, sampler->vocab_size);
+    }
+    int n = sampler->vocab_size;
+    ProbIndex *candidates = sampler->probindex;
+    for (int i = 0; i < n; i++)
+    {
+        candidates[i].prob = logits[i];
+        candidates[i].index = i;
+    }
+    // top-k: only the k most likely tokens survive, selected on the logits
+    // since the softmax doesn't change their order
+    if (sampler->topk > 0 && sampler->topk < n)
+    {
+        select_top(candidates, n, sampler->topk);
+        n = sampler->topk;
+    }
+    // apply the temperature and softmax to the survivors only
+    v4sf total = softmax_candidates(candidates, n, sampler->temperature);
+    // flip a (v4sf) coin (this is our source of entropy for sampling)
+    v4sf coin = random_f32(&sampler->rng_state);
+    if (sampler->topp > 0 && sampler->topp < 1)
+    {
+        // top-p (nucleus) sampling, clamping the least likely tokens to zero.
+        // probabilities smaller than (1 - topp) / (n - 1) cannot be part of the
+        // result, so for efficiency we crop these out before the heap
+        const v4sf cutoff = (1.0f - sampler->topp) / (n - 1) * total;
+        int n0 = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (candidates[i].prob >= cutoff)
+            {
+                candidates[n0++] = candidates[i];
+            }
+        }
+        return sample_topp(candidates, n0, total, sampler->topp, coin);
+    }
+    // simply sample from the predicted probability distribution
+    v4sf r = coin * total;
+    v4sf cdf = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        cdf += candidates[i].prob;
+        if (r < cdf)
+        {
+            return candidates[i].index;
+        }
+    }
+    return candidates[n - 1].index; // in case of rounding errors
+}
+
+void sampler_distribution(Sampler *sampler, v4sf *logits)
+{
+    // turns logits in place into the distribution sample() draws from, with
+    // the penalties, temperature, top-k and top-p applied. speculative decoding
+    // compares the draft and main models' distributions
+    int n = sampler->vocab_size;
+    apply_penalties(sampler, logits);
+    if (sampler->temperature == 0.0f)
+    {
+        int best = sample_argmax(logits, n);
+        memset(logits, 0, n * sizeof(v4sf));
+        logits[best] = 1.0f;
+        return;
+    }
+    ProbIndex *candidates = sampler->probindex;
+    for (int i = 0; i < n; i++)
+    {
+        candidates[i].prob = logits[i];
+        candidates[i].index = i;
+    }
+    int n0 = n;
+    if (sampler->topk > 0 && sampler->topk < n)
+    {
+        select_top(candidates, n, sampler->topk);
+        n0 = sampler->topk;
+    }
+    v4sf total = softmax_candidates(candidates, n0, sampler->temperature);
+    int first = 0;
+    if (sampler->topp > 0 && sampler->topp < 1)
+    {
+        first = nucleus(candidates, n0, total, sampler->topp, &total);
+    }
+    memset(logits, 0, n * sizeof(v4sf));
+    for (int i = first; i < n0; i++)
+    {
+        logits[candidates[i].index] = candidates[i].prob / total;
+    }
+}
+
+int sample_residual(v4sf *p, v4sf *q, int n, v4sf coin)
+{
+    // samples from max(0, p - q) normalized, the correction after a draft
+    // token sampled from q was rejected by p
+    v4sf total = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        total += p[i] > q[i] ? p[i] - q[i] : 0.0f;
+    }
+    if (total <= 0.0f)
+    {
+        return sample_mult(p, n, coin); // p == q up to rounding
+    }
+    v4sf r = coin * total;
+    v4sf cdf = 0.0f;
+    int last = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (p[i] > q[i])
+        {
+            cdf += p[i] - q[i];
+            last = i;
+            if (r < cdf)
+            {
+                return i;
+            }
+        }
+    }
+    return last; // in case of rounding errors
 }
 
 // ----------------------------------------------------------------------------
@@ -1021,65 +2929,384 @@ long time_in_ms()
 // ----------------------------------------------------------------------------
 // generation loop
 
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_flow_cb cb_token)
+int lookup_draft(int *context, int n, int max_ngram, int k, int *draft)
+{
+    // prompt lookup: find the latest earlier occurrence of the longest suffix of
+    // the context (up to max_ngram tokens) and draft the tokens that followed it
+    for (int ngram = max_ngram < n - 1 ? max_ngram : n - 1; ngram >= 1; ngram--)
+    {
+        int *suffix = context + n - ngram;
+        for (int i = n - ngram - 1; i >= 0; i--)
+        {
+            if (memcmp(context + i, suffix, ngram * sizeof(int)) == 0)
+            {
+                int count = 0;
+                for (int j = i + ngram; j < n && count < k; j++)
+                {
+                    draft[count++] = context[j];
+                }
+                return count;
+            }
+        }
+    }
+    return 0;
+}
+
+int draft_tokens(Transformer *draft, Sampler *sampler, int *context, int pos, int *draft_pos, int k, int *tokens, v4sf *probs)
+{
+    // catches the draft model's kv cache up with the context, then samples k
+    // tokens from it, keeping the distribution (k, vocab_size) each came from
+    int vocab_size = draft->config.vocab_size;
+    for (; *draft_pos < pos; (*draft_pos)++)
+    {
+        forward_layers(draft, context[*draft_pos], *draft_pos);
+    }
+    int token = context[pos];
+    for (int i = 0; i < k; i++)
+    {
+        v4sf *q = probs + i * vocab_size;
+        memcpy(q, forward(draft, token, pos + i), vocab_size * sizeof(v4sf));
+        sampler_distribution(sampler, q);
+        token = tokens[i] = sample_mult(q, vocab_size, random_f32(&sampler->rng_state));
+    }
+    *draft_pos = pos + k;
+    return k;
+}
+
+void build_session(Session *s, Transformer *t, Transformer *draft, int max_prompt)
+{
+    // one arena for every buffer generate() needs, so a query with a prompt of
+    // up to max_prompt bytes runs without touching the heap
+    int max_tokens = max_prompt + 3; // +3 for '\0', ?BOS, ?EOS
+    s->max_prompt = max_prompt;
+    s->max_batch = t->state.max_batch;
+    s->encode.capacity = max_tokens;
+    size_t draft_floats = draft ? (size_t)(s->max_batch - 1) * t->config.vocab_size : 0;
+    size_t size = arena_align(max_tokens * sizeof(int)) + arena_align(t->config.seq_len * sizeof(int)) +
+                  2 * arena_align(s->max_batch * sizeof(int)) + arena_align(draft_floats * sizeof(v4sf)) +
+                  arena_align(2 * max_tokens * sizeof(int)) + arena_align(3 * max_tokens * sizeof(MergeCandidate)) +
+                  arena_align(t->config.seq_len * sizeof(int32_t));
+    s->arena = arena_alloc(size, ARENA_INTERNAL, MEM_SESSION);
+    if (!s->arena)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
+    char *next = s->arena;
+    s->prompt_tokens = (int *)next;
+    next += arena_align(max_tokens * sizeof(int));
+    s->context = (int *)next;
+    next += arena_align(t->config.seq_len * sizeof(int));
+    s->batch = (int *)next;
+    next += arena_align(s->max_batch * sizeof(int));
+    s->out = (int *)next;
+    next += arena_align(s->max_batch * sizeof(int));
+    s->draft_probs = draft ? (v4sf *)next : NULL;
+    next += arena_align(draft_floats * sizeof(v4sf));
+    s->encode.links = (int *)next;
+    next += arena_align(2 * max_tokens * sizeof(int));
+    s->encode.heap = (MergeCandidate *)next;
+    next += arena_align(3 * max_tokens * sizeof(MergeCandidate));
+    s->latencies = (int32_t *)next;
+    ESP_LOGI(TAG, "Session: %zu bytes for prompts of up to %d bytes", size, max_prompt);
+}
+
+void free_session(Session *s)
+{
+    mem_free(s->arena, MEM_SESSION);
+    s->arena = NULL;
+}
+
+int compare_latencies(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int32_t *sorted, int n, int pct)
+{
+    // nearest rank
+    if (n == 0)
+    {
+        return 0;
+    }
+    int rank = (pct * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void finish_metrics(GenerationMetrics *m, int32_t *latencies, int64_t first_us, int64_t last_us)
+{
+    // latencies holds one entry per generated token after the first, sorted in place
+    int n = m->generated_tokens > 1 ? m->generated_tokens - 1 : 0;
+    qsort(latencies, n, sizeof(int32_t), compare_latencies);
+    m->itl_p50_us = percentile(latencies, n, 50);
+    m->itl_p90_us = percentile(latencies, n, 90);
+    m->itl_p99_us = percentile(latencies, n, 99);
+    m->decode_us = last_us - first_us;
+    m->prefill_tok_s = m->prefill_us > 0 ? m->prompt_tokens * 1e6f / m->prefill_us : 0.0f;
+    m->decode_tok_s = m->decode_us > 0 ? n * 1e6f / m->decode_us : 0.0f;
+}
+
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_flow_cb cb_token, GenerateOptions *opts)
 {
+    int64_t call_us = esp_timer_get_time();
     char *empty_prompt = "";
     if (prompt == NULL)
     {
         prompt = empty_prompt;
     }
 
+    // speculative decoding drafts tokens by looking up the context so far,
+    // or with a smaller model sharing the tokenizer
+    int speculate = opts ? opts->speculate : 0;
+    int lookup_ngram = opts && opts->lookup_ngram > 0 ? opts->lookup_ngram : 1;
+    speculate = speculate < transformer->state.max_batch - 1 ? speculate : transformer->state.max_batch - 1;
+    Transformer *draft = opts && speculate > 0 ? opts->draft : NULL;
+    int seq_len = transformer->config.seq_len;
+    if (draft)
+    {
+        if (draft->config.vocab_size != transformer->config.vocab_size)
+        {
+            ESP_LOGW(TAG, "Draft model has a different vocabulary, not using it");
+            draft = NULL;
+        }
+        else
+        {
+            seq_len = draft->config.seq_len < seq_len ? draft->config.seq_len : seq_len;
+        }
+    }
+    // steps past the end of the kv cache have nowhere to go
+    steps = steps < seq_len ? steps : seq_len;
+
+    // all the buffers come from the session, only calls without a fitting one allocate
+    Session temp = {0};
+    Session *session = opts ? opts->session : NULL;
+    int prompt_len = strlen(prompt);
+    if (session == NULL || prompt_len > session->max_prompt || (draft && !session->draft_probs))
+    {
+        build_session(&temp, transformer, draft, prompt_len);
+        session = &temp;
+    }
+
     // encode the (string) prompt into tokens sequence
     int num_prompt_tokens = 0;
-    int *prompt_tokens = (int *)malloc((strlen(prompt) + 3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
-    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
+    int *prompt_tokens = session->prompt_tokens;
+    encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens, &session->encode);
     if (num_prompt_tokens < 1)
     {
         ESP_LOGE(TAG, "something is wrong, expected at least 1 prompt token");
         exit(EXIT_FAILURE);
     }
 
+    taskENTER_CRITICAL(&stream_stats_lock);
+    transformer->stream.read_us = 0;
+    transformer->stream.read_bytes = 0;
+    taskEXIT_CRITICAL(&stream_stats_lock);
+    transformer->stream.stall_us = 0;
+    transformer->shortlist.hits = 0;
+    transformer->shortlist.fallbacks = 0;
+    if (transformer->profile)
+    {
+        profile_reset(transformer->profile);
+    }
+    long gen_start = time_in_ms();
+    sampler_reset(sampler);
+    StopMatcher *stop = opts ? opts->stop : NULL;
+    if (stop)
+    {
+        stop_matcher_reset(stop);
+    }
+    volatile int *cancel = opts ? opts->cancel : NULL;
+    int *context = session->context; // the token at each position
+    int *batch = session->batch; // current token and its drafts
+    int *out = session->out; // tokens produced by a step
+    int drafted = 0;
+    int accepted = 0;
+    int draft_pos = 0; // positions of the draft model's kv cache that match the context
+    v4sf *draft_probs = session->draft_probs;
+    GenerationMetrics metrics = {.prompt_tokens = num_prompt_tokens};
+    int32_t *latencies = session->latencies;
+    int64_t first_token_us = 0;
+    int64_t last_token_us = 0;
+    int64_t prefill_start_us = esp_timer_get_time();
+
     // start the main loop
     long start = 0;               // used to time our code, only initialized after first iteration
     int next;                     // will store the next token in the sequence
     int token = prompt_tokens[0]; // kick off with the first token in the prompt
     int pos = 0;                  // position in the sequence
-    while (pos < steps)
+    int done = 0;
+    while (pos < steps && !done && !(cancel && *cancel))
     {   
         //esp_task_wdt_reset();
-        // forward the transformer to get logits for the next token
-        v4sf *logits = forward(transformer, token, pos);
-
-        // advance the state machine
+        int64_t pass_start_us = esp_timer_get_time();
+        int generated_before = metrics.generated_tokens;
+        // the token entering the sequence joins the penalty window
+        sampler_accept(sampler, token);
+        context[pos] = token;
+        int n_out = 1;
+        int n_draft = 0;
+        if (pos >= num_prompt_tokens - 1 && speculate > 0)
+        {
+            // never draft past steps or the end of the kv cache
+            int limit = speculate;
+            limit = limit < steps - pos - 1 ? limit : steps - pos - 1;
+            limit = limit < seq_len - pos - 1 ? limit : seq_len - pos - 1;
+            if (limit > 0 && draft)
+            {
+                n_draft = draft_tokens(draft, sampler, context, pos, &draft_pos, limit, batch + 1, draft_probs);
+            }
+            else if (limit > 0)
+            {
+                n_draft = lookup_draft(context, pos + 1, lookup_ngram, limit, batch + 1);
+            }
+        }
+        // forward the transformer and advance the state machine
         if (pos < num_prompt_tokens - 1)
         {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
+            // if we are still processing the input prompt, force the next prompt token.
+            // its logits would be thrown away, so skip the classifier
+            forward_layers(transformer, token, pos);
+            out[0] = prompt_tokens[pos + 1];
+        }
+        else if (n_draft > 0 && draft)
+        {
+            // the standard speculative sampling rule: keep draft token d with
+            // probability min(1, p(d) / q(d)), p being the main model's
+            // distribution and q the draft's. on rejection sample max(0, p - q)
+            // instead. the output follows p exactly, for any sampler settings
+            int vocab_size = transformer->config.vocab_size;
+            batch[0] = token;
+            v4sf *logits = forward_batch(transformer, batch, n_draft + 1, pos);
+            n_out = 0;
+            for (int b = 0; b <= n_draft; b++)
+            {
+                v4sf *p = logits + b * vocab_size;
+                sampler_distribution(sampler, p);
+                if (b == n_draft)
+                {
+                    // every draft was kept, the last position gives one more token
+                    out[n_out++] = sample_mult(p, vocab_size, random_f32(&sampler->rng_state));
+                    break;
+                }
+                int d = batch[b + 1];
+                v4sf *q = draft_probs + b * vocab_size;
+                if (random_f32(&sampler->rng_state) * q[d] < p[d])
+                {
+                    out[n_out++] = d;
+                    sampler_accept(sampler, d);
+                    continue;
+                }
+                out[n_out++] = sample_residual(p, q, vocab_size, random_f32(&sampler->rng_state));
+                break;
+            }
+            drafted += n_draft;
+            accepted += n_out - 1;
+            // the draft model ran positions pos..pos+n_draft-1, the ones past the
+            // first rejection hold tokens that are no longer in the context
+            int kept = n_out - 1 < n_draft - 1 ? n_out - 1 : n_draft - 1;
+            draft_pos = pos + 1 + kept;
+        }
+        else if (n_draft > 0)
+        {
+            // verify the drafts in one pass: sampling each position as usual,
+            // a draft is kept while it matches what was sampled, and the first
+            // mismatch is replaced by the sampled token. that keeps the output
+            // distribution unchanged, and exactly the same when greedy
+            batch[0] = token;
+            v4sf *logits = forward_batch(transformer, batch, n_draft + 1, pos);
+            n_out = 0;
+            for (int b = 0; b <= n_draft; b++)
+            {
+                out[n_out++] = sample(sampler, logits + b * transformer->config.vocab_size);
+                if (b == n_draft || out[b] != batch[b + 1])
+                {
+                    break;
+                }
+                sampler_accept(sampler, out[b]);
+            }
+            drafted += n_draft;
+            accepted += n_out - 1;
+        }
+        else if (sampler->temperature == 0.0f)
+        {
+            // greedy argmax sampling, fused with the classifier
+            out[0] = forward_argmax(transformer, sampler, token, pos);
         }
         else
         {
+            v4sf *logits = forward(transformer, token, pos);
             // print all logits for debugging
             // for (int i = 0; i < tokenizer->vocab_size; i++) {
             //     printf("logit [%d] %f \n", i, logits[i]);
             // }
             // printf("\n");
             // otherwise sample the next token from the logits
-            next = sample(sampler, logits);
+            out[0] = sample(sampler, logits);
         }
-        pos++;
 
-        // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if (next == 1)
+        for (int i = 0; i < n_out && !done; i++)
         {
-            break;
+            next = out[i];
+            pos++;
+
+            // data-dependent terminating condition: the BOS (=1) token delimits sequences
+            if (next == 1)
+            {
+                done = 1;
+                break;
+            }
+
+            // print the token as string, decode it with the Tokenizer object
+            int piece_len, printable;
+            char *piece = decode(tokenizer, token, next, &piece_len, &printable);
+            safe_printf(piece, piece_len, printable); // same as printf("%s", piece), but skips "unsafe" bytes
+            cb_token(piece, piece_len);
+            token = next;
+            if (i < n_out - 1)
+            {
+                // an accepted draft, already in the kv cache and the penalty window
+                context[pos] = token;
+            }
+
+            if (pos >= num_prompt_tokens)
+            {
+                metrics.generated_tokens++;
+            }
+            // the prompt is echoed too, only generated text can complete a stop sequence
+            if (stop && pos >= num_prompt_tokens && stop_matcher_feed(stop, piece))
+            {
+                done = 1;
+            }
+        }
+
+        // the pass's tokens share its time, those arriving with the first
+        // generated one only the pass itself
+        int produced = metrics.generated_tokens - generated_before;
+        if (produced > 0)
+        {
+            int64_t now = esp_timer_get_time();
+            int64_t since = last_token_us;
+            if (generated_before == 0)
+            {
+                first_token_us = now;
+                metrics.ttft_us = now - call_us;
+                metrics.prefill_us = now - prefill_start_us;
+                since = pass_start_us;
+            }
+            for (int i = generated_before > 0 ? 0 : 1; i < produced; i++)
+            {
+                latencies[generated_before + i - 1] = (int32_t)((now - since) / produced);
+            }
+            last_token_us = now;
         }
 
-        // print the token as string, decode it with the Tokenizer object
-        char *piece = decode(tokenizer, token, next);
-        safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
-        cb_token(piece);
-        fflush(stdout);
-        token = next;
+        check_run_state(&transformer->state, &transformer->config);
+        if (draft)
+        {
+            check_run_state(&draft->state, &draft->config);
+        }
 
         // init the timer here because the first iteration can be slower
         if (start == 0)
@@ -1087,7 +3314,7 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
             start = time_in_ms();
         }
     }
-    printf("\n");
+    console_write("\n", 1);
 
     // report achieved tok/s (pos-1 because the timer starts after first iteration)
     if (pos > 1)
@@ -1097,8 +3324,53 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         fprintf(stderr, "achieved tok/s: %f\n", tks);
         cb_done(tks);
     }
+    else
+    {
+        // stopped after the first token, callers still wait for completion
+        cb_done(0.0f);
+    }
+    finish_metrics(&metrics, latencies, first_token_us, last_token_us);
+    if (opts && opts->metrics)
+    {
+        *opts->metrics = metrics;
+    }
+    if (metrics.generated_tokens > 0)
+    {
+        ESP_LOGI(TAG, "TTFT %lld ms, prefill %d tokens at %.1f tok/s, decode %.2f tok/s, token latency p50 %lld p90 %lld p99 %lld ms",
+                 metrics.ttft_us / 1000, metrics.prompt_tokens, metrics.prefill_tok_s, metrics.decode_tok_s,
+                 metrics.itl_p50_us / 1000, metrics.itl_p90_us / 1000, metrics.itl_p99_us / 1000);
+    }
+    if (transformer->profile)
+    {
+        profile_log(transformer->profile);
+    }
+    if (transformer->stream.enabled)
+    {
+        // flash read bandwidth against the time forward() spent on compute
+        LayerStream *ls = &transformer->stream;
+        long total_ms = time_in_ms() - gen_start;
+        taskENTER_CRITICAL(&stream_stats_lock);
+        size_t read_bytes = ls->read_bytes;
+        int64_t read_us = ls->read_us;
+        taskEXIT_CRITICAL(&stream_stats_lock);
+        float mb_s = read_us > 0 ? read_bytes / (float)read_us : 0.0f;
+        ESP_LOGI(TAG, "Layer streaming: %zu bytes in %lld ms (%.2f MB/s), stalled %lld ms of %ld ms",
+                 read_bytes, read_us / 1000, mb_s, ls->stall_us / 1000, total_ms);
+    }
+
+    if (transformer->shortlist.size > 0)
+    {
+        Shortlist *sl = &transformer->shortlist;
+        ESP_LOGI(TAG, "Classifier shortlist: %d tokens from the shortlist, %d full fallbacks",
+                 sl->hits, sl->fallbacks);
+    }
+
+    if (drafted > 0)
+    {
+        ESP_LOGI(TAG, "Speculative decoding: %d of %d drafted tokens accepted", accepted, drafted);
+    }
 
-    free(prompt_tokens);
+    free_session(&temp);
     ESP_LOGI(TAG, "Generate complete");
 }
 
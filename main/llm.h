@@ -10,11 +10,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "llm_stop.h"
 
 typedef float v4sf __attribute__((aligned(16)));
 
@@ -25,10 +28,23 @@ typedef struct {
 
 typedef struct {
     int vocab_size;
-    ProbIndex* probindex; // buffer used in top-p sampling
+    ProbIndex* probindex; // candidates for top-k and top-p sampling
     float temperature;
     float topp;
+    int topk; // sample from the k most likely tokens only, 0 keeps every token
     unsigned long long rng_state;
+    // penalties for the tokens seen in the last penalty_window tokens
+    float repetition_penalty; // divides positive logits and multiplies negative ones, 1 is off
+    float presence_penalty; // subtracted once from the logit of a seen token
+    float frequency_penalty; // subtracted for every occurrence of a seen token
+    int penalty_window; // 0 disables the penalties
+    int* history; // ring buffer of the last penalty_window tokens
+    int history_len;
+    int history_head; // next slot to write
+    uint16_t* counts; // (vocab_size,) occurrences of each token in the window
+    int* unique; // tokens with a nonzero count, so penalties cost O(unique tokens)
+    uint16_t* unique_slot; // (vocab_size,) position of each token in unique
+    int n_unique;
 } Sampler;
 
 typedef struct {
@@ -37,12 +53,73 @@ typedef struct {
 } TokenIndex;
 
 typedef struct {
-    char** vocab;
-    v4sf* vocab_scores;
-    TokenIndex *sorted_vocab;
+    uint32_t pair; // left token id << 16 | right token id
+    int id; // the token the pair merges into, -1 for an empty slot
+} MergeEntry;
+
+typedef struct {
+    // what decode() returns for a token, worked out once at load
+    uint32_t offset; // of the piece in pieces, or the byte value of a raw byte token
+    uint16_t len; // bytes of the decoded piece
+    uint8_t flags; // DECODE_*
+} DecodeEntry;
+
+#define DECODE_BYTE 1 // a raw byte token like '<0x0A>', decodes to the byte itself
+#define DECODE_PRINTABLE 2 // not a lone control byte, see safe_printf()
+#define DECODE_SPACE 4 // starts with a space, which is stripped after BOS
+#define DECODE_SPACE_PRINTABLE 8 // DECODE_PRINTABLE for the stripped piece
+
+typedef struct {
+    // a pair of adjacent tokens that merges, on the heap encode() merges from
+    v4sf score; // score of the merged token
+    int left; // position of the pair's left token
+    int right; // position of its right neighbour when pushed
+    int left_id; // the two tokens when pushed, to spot pairs an earlier merge changed
+    int right_id;
+    int id; // the merged token
+} MergeCandidate;
+
+typedef struct {
+    // encode()'s working memory for prompts of up to capacity tokens
+    int capacity;
+    int* links; // (2, capacity) previous and next token of the linked list
+    MergeCandidate* heap; // (3 * capacity,)
+} EncodeScratch;
+
+#define TOKENIZER_MAGIC 0x544D4C4C // "LLMT"
+#define TOKENIZER_VERSION 2
+#define TRIE_NO_TOKEN 0xffff
+
+typedef struct {
+    // a prebuilt tokenizer image, written by tools/pack_tokenizer.py. the header
+    // is followed by the tables in the order of Tokenizer's pointers, each one
+    // a multiple of 4 bytes so the image is used in place
+    uint32_t magic; // TOKENIZER_MAGIC, a llama2.c tokenizer starts with max_token_length instead
+    uint32_t version;
+    uint32_t vocab_size;
+    uint32_t max_token_length;
+    uint32_t merge_slots; // a power of two
+    uint32_t pool_size; // bytes of null terminated strings, padded to 4
+    uint32_t trie_nodes;
+} TokenizerHeader;
+
+typedef struct {
+    void* image; // the tokenizer image, every table below points into it
+    v4sf* vocab_scores; // (vocab_size,)
+    uint32_t* offsets; // (vocab_size,) offset of each token's string in pieces
+    const char* pieces; // the null terminated token strings
+    // byte trie of the token strings, nodes in breadth first order so the
+    // children of a node are consecutive nodes, sorted by their byte
+    uint32_t* trie_child; // (trie_nodes + 1,) first child of each node
+    uint16_t* trie_token; // (trie_nodes,) token spelled by the path to each node, TRIE_NO_TOKEN if none
+    uint8_t* trie_byte; // (trie_nodes,) byte on the edge into each node
+    MergeEntry* merges; // open addressing hash table of every pair of tokens that merges into a token
+    DecodeEntry* decode_table; // (vocab_size,) built at load, not part of the image
     int vocab_size;
     unsigned int max_token_length;
     unsigned char byte_pieces[512]; // stores all single-byte strings
+    uint32_t merge_mask; // number of merge slots - 1, a power of two
+    int trie_nodes;
 } Tokenizer;
 
 typedef struct {
@@ -55,6 +132,41 @@ typedef struct {
     int seq_len; // max sequence length
 } Config;
 
+typedef enum {
+    // the matmul weights of a layer, in checkpoint order
+    TENSOR_WQ, // (dim, n_heads * head_size)
+    TENSOR_WK, // (dim, n_kv_heads * head_size)
+    TENSOR_WV, // (dim, n_kv_heads * head_size)
+    TENSOR_WO, // (n_heads * head_size, dim)
+    TENSOR_W1, // (hidden_dim, dim)
+    TENSOR_W2, // (dim, hidden_dim)
+    TENSOR_W3, // (hidden_dim, dim)
+    LAYER_TENSORS,
+    TENSOR_WCLS = LAYER_TENSORS, // the classifier, only used by checkpoint extensions
+} LayerTensor;
+
+typedef struct {
+    // a (rows, cols) matrix pruned to blocks of 1 x block weights. only the
+    // nonzero blocks are stored, row by row
+    int rows;
+    int cols;
+    int block;
+    int nnz_blocks;
+    int split_row; // first row of the second core's share, balances the nonzero blocks
+    const uint32_t* row_ptr; // (rows + 1) index of each row's first block
+    const uint16_t* block_col; // (nnz_blocks) column of each block, in blocks
+    const v4sf* values; // (nnz_blocks, block)
+} SparseMatrix;
+
+typedef struct {
+    // a (rows, cols) matrix factorized as U @ V, applied as two smaller matmuls
+    int rows;
+    int cols;
+    int rank;
+    const v4sf* u; // (rows, rank)
+    const v4sf* v; // (rank, cols)
+} LowRankMatrix;
+
 typedef struct {
     // token embedding table
     v4sf* token_embedding_table;    // (vocab_size, dim)
@@ -74,8 +186,62 @@ typedef struct {
     v4sf* rms_final_weight; // (dim,)
     // (optional) classifier weights for the logits, on the last layer
     v4sf* wcls;
+    // block sparse replacements, (layer, LAYER_TENSORS), rows == 0 when dense
+    SparseMatrix* sparse;
+    // low-rank replacements, (layer, LAYER_TENSORS) then one for wcls, rank == 0 when full rank
+    LowRankMatrix* lowrank;
 } TransformerWeights;
 
+typedef struct {
+    // the matmul weights of a single layer, either offsets into
+    // TransformerWeights or one of the streaming layer buffers
+    v4sf* w[LAYER_TENSORS];
+    // block sparse replacements from the checkpoint, NULL when dense
+    const SparseMatrix* sparse[LAYER_TENSORS];
+    // low-rank replacements from the checkpoint, NULL when full rank
+    const LowRankMatrix* lowrank[LAYER_TENSORS];
+} LayerWeights;
+
+typedef struct {
+    // out-of-core mode: only embeddings, rmsnorms and the classifier stay
+    // resident, each layer's matmul weights are read from the checkpoint
+    // into one of two layer buffers while the previous layer computes
+    int enabled;
+    FILE* file; // checkpoint, kept open for the lifetime of the transformer
+    v4sf* slots[2]; // the two layer buffers
+    int slot_layer[2]; // layer held (or being loaded) by each slot, -1 if none
+    long tensor_offset[LAYER_TENSORS]; // file offset of each tensor for layer 0, in bytes
+    size_t tensor_size[LAYER_TENSORS]; // per layer size of each tensor, in floats
+    size_t layer_size; // floats per layer buffer
+    QueueHandle_t requests; // LayerRequest items for the loader task
+    EventGroupHandle_t ready; // one bit per slot, set once its layer is loaded
+    TaskHandle_t loader;
+    // benchmark counters, reset by generate(), the two the loader updates under a lock
+    int64_t read_us; // time the loader spent reading
+    size_t read_bytes; // bytes read from flash
+    int64_t stall_us; // time forward() spent waiting on a layer
+    void* extensions; // checkpoint extensions, read separately since the layers aren't resident
+    TransformerWeights* weights; // dense tensors with a sparse or low-rank replacement aren't read
+} LayerStream;
+
+typedef struct {
+    // shortlisted classifier: the low-rank wcls scores the whole vocabulary as
+    // a proxy, exact logits are only computed for the best candidates
+    int size; // number of candidates, 0 when disabled
+    float margin; // the exact winner must beat the best proxy score left out by this much
+    int* candidates; // (size + 1,) proxy top candidates, then the best one left out
+    float* exact; // (size,) exact logits of the candidates
+    // counters, reset by generate()
+    int hits;
+    int fallbacks; // tokens that needed the full classifier
+} Shortlist;
+
+typedef enum {
+    ARENA_INTERNAL, // internal RAM, for the buffers every kernel touches
+    ARENA_PSRAM, // external RAM when there is some, for the large buffers
+    ARENA_REGIONS,
+} ArenaRegion;
+
 typedef struct {
     // current wave of activations
     v4sf *x; // activation at current time stamp (dim,)
@@ -88,12 +254,30 @@ typedef struct {
     v4sf *v; // value (dim,)
     v4sf *att; // buffer for scores/attention values (n_heads, seq_len)
     v4sf *logits; // output logits
+    v4sf *lowrank; // V @ x of a low-rank projection (max_rank,)
+    int max_rank;
     // kv cache
     v4sf* key_cache;   // (layer, seq_len, dim)
     v4sf* value_cache; // (layer, seq_len, dim)
+    // the same buffers for a batch of consecutive positions, used to verify
+    // speculative drafts. rejected positions are rolled back simply by
+    // decoding over them, the kv cache is indexed by position
+    int max_batch;
+    v4sf *bx; // (max_batch, dim)
+    v4sf *bxb; // (max_batch, dim)
+    v4sf *bxb2; // (max_batch, dim)
+    v4sf *bhb; // (max_batch, hidden_dim)
+    v4sf *bhb2; // (max_batch, hidden_dim)
+    v4sf *bq; // (max_batch, dim)
+    v4sf *blogits; // (max_batch, vocab_size)
+    // every buffer above is carved out of one arena per region, see malloc_run_state()
+    void* arena[ARENA_REGIONS];
 } RunState;
 
 
+typedef struct WorkerPool WorkerPool; // the second core's tasks and their semaphores, private to llm.c
+typedef struct Profile Profile; // see llm_profile.h
+
 typedef struct {
     Config config; // the hyperparameters of the architecture (the blueprint)
     TransformerWeights weights; // the weights of the model
@@ -102,16 +286,65 @@ typedef struct {
     int fd; // file descriptor for memory mapping
     v4sf* data; // memory mapped data pointer
     size_t file_size; // size of the checkpoint file in bytes
+    LayerStream stream; // layer streaming state, unused when the model is resident
+    Shortlist shortlist; // shortlisted classifier state, unused when disabled
+    WorkerPool* pool; // this transformer's workers, see build_workers()
+    Profile* profile; // op cycle counts since generate() started, NULL unless CONFIG_LLM_PROFILE
 } Transformer;
 
 typedef void (*generated_complete_cb)(float tokens_ps);
-typedef void (*token_flow_cb)(char* token);
+typedef void (*token_flow_cb)(char* token, int len);
+
+typedef struct {
+    // everything generate() needs besides the models' RunState, allocated once
+    // so a query never touches the heap. sized for one model (and its draft) and
+    // prompts of up to max_prompt bytes
+    int max_prompt; // bytes
+    int max_batch; // current token and its drafts
+    int* prompt_tokens; // (max_prompt + 3,) the prompt with BOS, worst case one token per byte
+    int* context; // (seq_len,) the token at each position
+    int* batch; // (max_batch,) current token and its drafts
+    int* out; // (max_batch,) tokens produced by a step
+    v4sf* draft_probs; // (max_batch - 1, vocab_size) the draft model's distributions, NULL without a draft
+    EncodeScratch encode;
+    int32_t* latencies; // (seq_len,) microseconds taken by each generated token, for the metrics
+    void* arena; // every buffer above
+} Session;
+
+typedef struct {
+    // timings of one generate() call in microseconds, from esp_timer. a prompt
+    // token is forced, a generated one is sampled
+    int prompt_tokens;
+    int generated_tokens;
+    int64_t prefill_us; // the prompt's forward passes, up to the first generated token
+    int64_t ttft_us; // from the call to the first generated token, tokenizing included
+    int64_t decode_us; // from the first generated token to the last
+    int64_t itl_p50_us; // inter token latency percentiles, a pass producing
+    int64_t itl_p90_us; // several tokens spreads its time over them
+    int64_t itl_p99_us;
+    float prefill_tok_s;
+    float decode_tok_s; // after the first generated token
+} GenerationMetrics;
+
+typedef struct {
+    // optional knobs for generate(), a NULL options pointer uses the defaults
+    StopMatcher* stop; // ends generation once the output completes a stop sequence, NULL for none
+    int speculate; // draft tokens verified per forward pass, 0 disables speculative decoding
+    int lookup_ngram; // longest suffix of the context looked up to draft tokens
+    Transformer* draft; // smaller model sharing the tokenizer that drafts instead of the lookup, NULL for none
+    Session* session; // preallocated scratch, NULL allocates it for each call
+    volatile int* cancel; // checked before each forward pass, nonzero stops generation. NULL for none
+    GenerationMetrics* metrics; // filled in when generation ends, NULL for none
+} GenerateOptions;
 
 void build_transformer(Transformer *t, char* checkpoint_path);
 void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size);
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed);
-void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_flow_cb cb_token);
+void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_flow_cb cb_token, GenerateOptions *opts);
+void build_session(Session* s, Transformer* t, Transformer* draft, int max_prompt);
+void sampler_set_penalties(Sampler* sampler, float repetition, float presence, float frequency, int window);
 void free_sampler(Sampler* sampler);
+void free_session(Session* s);
 void free_transformer(Transformer* t);
 void free_tokenizer(Tokenizer* t);
 
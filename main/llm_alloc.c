@@ -0,0 +1,142 @@
+#include "llm_alloc.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_log.h"
+
+static const char *TAG = "LLM_ALLOC";
+
+static const char *tag_names[MEM_TAGS] = {"weights", "weight tables", "layer stream", "shortlist", "activations",
+                                          "kv cache", "session", "workers", "tokenizer", "sampler",
+                                          "stop matcher", "profile", "console", "scratch"};
+
+// updated from whichever task allocates, the loader, a service or a bench
+static struct
+{
+    _Atomic size_t current[MEM_REGIONS];
+    _Atomic size_t peak[MEM_REGIONS];
+    _Atomic uint32_t blocks;
+} usage[MEM_TAGS];
+
+static inline MemRegion region_of(const void *ptr)
+{
+    return esp_ptr_external_ram(ptr) ? MEM_PSRAM : MEM_INTERNAL;
+}
+
+static void account(void *ptr, MemTag tag)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    MemRegion r = region_of(ptr);
+    size_t size = heap_caps_get_allocated_size(ptr);
+    size_t now = atomic_fetch_add_explicit(&usage[tag].current[r], size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&usage[tag].peak[r], memory_order_relaxed);
+    while (now > peak && !atomic_compare_exchange_weak_explicit(&usage[tag].peak[r], &peak, now,
+                                                                memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+    atomic_fetch_add_explicit(&usage[tag].blocks, 1, memory_order_relaxed);
+}
+
+static void unaccount(void *ptr, MemTag tag)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    atomic_fetch_sub_explicit(&usage[tag].current[region_of(ptr)], heap_caps_get_allocated_size(ptr),
+                              memory_order_relaxed);
+    atomic_fetch_sub_explicit(&usage[tag].blocks, 1, memory_order_relaxed);
+}
+
+void *mem_malloc(size_t size, MemTag tag, uint32_t caps)
+{
+    void *ptr = caps == MEM_CAPS_DEFAULT ? malloc(size) : heap_caps_malloc(size, caps);
+    account(ptr, tag);
+    return ptr;
+}
+
+void *mem_calloc(size_t n, size_t size, MemTag tag, uint32_t caps)
+{
+    void *ptr = caps == MEM_CAPS_DEFAULT ? calloc(n, size) : heap_caps_calloc(n, size, caps);
+    account(ptr, tag);
+    return ptr;
+}
+
+void *mem_aligned_calloc(size_t alignment, size_t n, size_t size, MemTag tag, uint32_t caps)
+{
+    void *ptr = heap_caps_aligned_calloc(alignment, n, size, caps == MEM_CAPS_DEFAULT ? MALLOC_CAP_8BIT : caps);
+    account(ptr, tag);
+    return ptr;
+}
+
+void *mem_realloc(void *ptr, size_t size, MemTag tag)
+{
+    // the old block is gone once realloc succeeds, count it out first and
+    // back in if it fails
+    unaccount(ptr, tag);
+    void *moved = realloc(ptr, size);
+    account(moved ? moved : ptr, tag);
+    return moved;
+}
+
+void mem_free(void *ptr, MemTag tag)
+{
+    unaccount(ptr, tag);
+    free(ptr);
+}
+
+void mem_usage(MemTag tag, MemUsage *u)
+{
+    for (int r = 0; r < MEM_REGIONS; r++)
+    {
+        u->current[r] = atomic_load_explicit(&usage[tag].current[r], memory_order_relaxed);
+        u->peak[r] = atomic_load_explicit(&usage[tag].peak[r], memory_order_relaxed);
+    }
+    u->blocks = atomic_load_explicit(&usage[tag].blocks, memory_order_relaxed);
+}
+
+const char *mem_tag_name(MemTag tag)
+{
+    return tag_names[tag];
+}
+
+void mem_log_map(void)
+{
+    ESP_LOGI(TAG, "%-14s %10s %10s %10s %10s %6s", "bytes", "internal", "peak", "psram", "peak", "blocks");
+    MemUsage total = {0};
+    for (int t = 0; t < MEM_TAGS; t++)
+    {
+        MemUsage u;
+        mem_usage(t, &u);
+        if (u.peak[MEM_INTERNAL] == 0 && u.peak[MEM_PSRAM] == 0)
+        {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-14s %10zu %10zu %10zu %10zu %6lu", tag_names[t], u.current[MEM_INTERNAL],
+                 u.peak[MEM_INTERNAL], u.current[MEM_PSRAM], u.peak[MEM_PSRAM], (unsigned long)u.blocks);
+        for (int r = 0; r < MEM_REGIONS; r++)
+        {
+            total.current[r] += u.current[r];
+            total.peak[r] += u.peak[r]; // peaks of different tags need not coincide, an upper bound
+        }
+        total.blocks += u.blocks;
+    }
+    ESP_LOGI(TAG, "%-14s %10zu %10zu %10zu %10zu %6lu", "total", total.current[MEM_INTERNAL],
+             total.peak[MEM_INTERNAL], total.current[MEM_PSRAM], total.peak[MEM_PSRAM], (unsigned long)total.blocks);
+
+    // a large free total split into small blocks can't hold the next kv cache
+    const uint32_t caps[MEM_REGIONS] = {MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, MALLOC_CAP_SPIRAM};
+    const char *names[MEM_REGIONS] = {"internal", "psram"};
+    for (int r = 0; r < MEM_REGIONS; r++)
+    {
+        size_t free_size = heap_caps_get_free_size(caps[r]);
+        size_t largest = heap_caps_get_largest_free_block(caps[r]);
+        int fragmented = free_size > largest ? 100 - (int)(largest * 100 / free_size) : 0;
+        ESP_LOGI(TAG, "%s: %zu bytes free, largest block %zu, %d%% fragmented, lowest free %zu", names[r], free_size,
+                 largest, fragmented, heap_caps_get_minimum_free_size(caps[r]));
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef LLM_ALLOC_H
+#define LLM_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The engine's allocations, each tagged with the subsystem it belongs to.
+ * Current and peak bytes are kept per tag and per memory region (internal RAM
+ * or PSRAM, from where the block actually landed), so a model's footprint can
+ * be planned against both. Blocks are counted at their real heap size.
+ * Frees take the tag the block was allocated with.
+ */
+
+typedef enum {
+    MEM_WEIGHTS, // the checkpoint, or its resident part when layers are streamed
+    MEM_WEIGHT_TABLES, // sparse and low rank tensor descriptors
+    MEM_LAYER_STREAM, // the two layer buffers and the extensions of a streamed checkpoint
+    MEM_SHORTLIST,
+    MEM_ACTIVATIONS, // the RunState arena in internal RAM
+    MEM_KV_CACHE, // the RunState arena in PSRAM, the kv cache and the batch logits
+    MEM_SESSION,
+    MEM_WORKERS,
+    MEM_TOKENIZER,
+    MEM_SAMPLER,
+    MEM_STOP_MATCHER,
+    MEM_PROFILE,
+    MEM_CONSOLE, // the console ring and the rendered reports
+    MEM_SCRATCH, // freed before the call that made it returns
+    MEM_TAGS,
+} MemTag;
+
+typedef enum {
+    MEM_INTERNAL,
+    MEM_PSRAM,
+    MEM_REGIONS,
+} MemRegion;
+
+#define MEM_CAPS_DEFAULT 0 // wherever malloc() would put it
+
+typedef struct {
+    size_t current[MEM_REGIONS]; // bytes
+    size_t peak[MEM_REGIONS];
+    uint32_t blocks;
+} MemUsage;
+
+// caps are heap_caps flags, or MEM_CAPS_DEFAULT
+void* mem_malloc(size_t size, MemTag tag, uint32_t caps);
+void* mem_calloc(size_t n, size_t size, MemTag tag, uint32_t caps);
+// no fallback, callers that can live in other memory retry with other caps
+void* mem_aligned_calloc(size_t alignment, size_t n, size_t size, MemTag tag, uint32_t caps);
+void* mem_realloc(void* ptr, size_t size, MemTag tag);
+void mem_free(void* ptr, MemTag tag);
+
+void mem_usage(MemTag tag, MemUsage* usage);
+const char* mem_tag_name(MemTag tag);
+// current and peak bytes per tag and region, and the fragmentation of each region
+void mem_log_map(void);
+
+#endif
@@ -0,0 +1,362 @@
+#include "llm_bench.h"
+#include "llm.h"
+#include "llm_console.h"
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "LLM_BENCH";
+
+#define BENCH_ITERATIONS 50
+
+int sample(Sampler *sampler, v4sf *logits);
+void pack_tokenizer(Tokenizer *t, const char *file, size_t file_size, int vocab_size);
+int str_lookup(Tokenizer *t, const char *str);
+int str_prefix_lookup(Tokenizer *t, const char *str, int *len);
+void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens, EncodeScratch *scratch);
+
+static int compare_prob(const void *a, const void *b)
+{
+    const ProbIndex *a_ = a;
+    const ProbIndex *b_ = b;
+    return a_->prob > b_->prob ? -1 : a_->prob < b_->prob ? 1 : 0;
+}
+
+static int sample_qsort(Sampler *sampler, v4sf *logits)
+{
+    // what the previous top-p implementation cost: softmax everything, then
+    // qsort every candidate above the cutoff. kept here as the baseline
+    int n = sampler->vocab_size;
+    v4sf max_val = logits[0];
+    for (int i = 1; i < n; i++)
+    {
+        max_val = logits[i] > max_val ? logits[i] : max_val;
+    }
+    v4sf sum = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        logits[i] = expf((logits[i] - max_val) / sampler->temperature);
+        sum += logits[i];
+    }
+    int n0 = 0;
+    const v4sf cutoff = (1.0f - sampler->topp) / (n - 1);
+    for (int i = 0; i < n; i++)
+    {
+        logits[i] /= sum;
+        if (logits[i] >= cutoff)
+        {
+            sampler->probindex[n0].index = i;
+            sampler->probindex[n0].prob = logits[i];
+            n0++;
+        }
+    }
+    qsort(sampler->probindex, n0, sizeof(ProbIndex), compare_prob);
+    return sampler->probindex[0].index;
+}
+
+static void fill_logits(v4sf *logits, int n, unsigned int *seed)
+{
+    // roughly the spread of real logits: a few strong tokens and a long tail
+    for (int i = 0; i < n; i++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        v4sf u = ((*seed >> 8) & 0xffff) / 65536.0f;
+        logits[i] = 8.0f * u * u * u - 2.0f;
+    }
+}
+
+void bench_sampler(void)
+{
+    const int vocab_sizes[] = {512, 4096, 32000};
+    const struct
+    {
+        const char *name;
+        float temperature;
+        float topp;
+        int topk;
+        int baseline;
+    } modes[] = {
+        {"greedy", 0.0f, 0.0f, 0, 0},
+        {"temperature", 1.0f, 1.0f, 0, 0},
+        {"top-k 40", 1.0f, 1.0f, 40, 0},
+        {"top-p 0.9", 1.0f, 0.9f, 0, 0},
+        {"top-k 40 top-p 0.9", 1.0f, 0.9f, 40, 0},
+        {"top-p 0.9 (qsort)", 1.0f, 0.9f, 0, 1},
+    };
+    for (int v = 0; v < sizeof(vocab_sizes) / sizeof(vocab_sizes[0]); v++)
+    {
+        int n = vocab_sizes[v];
+        v4sf *logits = malloc(n * sizeof(v4sf));
+        v4sf *scratch = malloc(n * sizeof(v4sf));
+        Sampler sampler;
+        build_sampler(&sampler, n, 1.0f, 0.9f, 42);
+        if (!logits || !scratch || !sampler.probindex)
+        {
+            ESP_LOGW(TAG, "Not enough memory for a vocabulary of %d", n);
+            free(logits);
+            free(scratch);
+            free_sampler(&sampler);
+            continue;
+        }
+        unsigned int seed = 1;
+        fill_logits(logits, n, &seed);
+        for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        {
+            sampler.temperature = modes[m].temperature;
+            sampler.topp = modes[m].topp;
+            sampler.topk = modes[m].topk;
+            int64_t elapsed = 0;
+            for (int i = 0; i < BENCH_ITERATIONS; i++)
+            {
+                // sampling works in place, start every run from the same logits
+                memcpy(scratch, logits, n * sizeof(v4sf));
+                int64_t start = esp_timer_get_time();
+                if (modes[m].baseline)
+                {
+                    sample_qsort(&sampler, scratch);
+                }
+                else
+                {
+                    sample(&sampler, scratch);
+                }
+                elapsed += esp_timer_get_time() - start;
+            }
+            ESP_LOGI(TAG, "vocab %5d  %-20s %8lld us/token", n, modes[m].name, elapsed / BENCH_ITERATIONS);
+        }
+        free(logits);
+        free(scratch);
+        free_sampler(&sampler);
+    }
+}
+
+static int compare_str(const void *a, const void *b)
+{
+    return strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+}
+
+static int lookup_bsearch(TokenIndex *sorted, int n, char *str)
+{
+    // what str_lookup() cost before the trie: a bsearch with strcmp over the
+    // sorted vocab. kept here as the baseline
+    TokenIndex tok = {.str = str};
+    TokenIndex *res = bsearch(&tok, sorted, n, sizeof(TokenIndex), compare_str);
+    return res != NULL ? res->id : -1;
+}
+
+static char random_letter(unsigned int *seed)
+{
+    // skewed towards the common letters, like real text
+    static const char letters[] = "etaoinshrdlucmfwypvbgkjqxz";
+    *seed = *seed * 1103515245 + 12345;
+    float u = ((*seed >> 8) & 0xffff) / 65536.0f;
+    return letters[(int)(u * u * 26)];
+}
+
+static char *synthetic_tokenizer(int n, unsigned int *seed, size_t *size)
+{
+    // a llama2.c tokenizer file in memory: <unk>, <s>, </s>, the byte tokens,
+    // the printable characters, then random words. longer words score lower,
+    // like merges learned later
+    char *file = malloc(sizeof(int) + n * (sizeof(float) + sizeof(int) + 16));
+    if (!file)
+    {
+        return NULL;
+    }
+    int max_len = 16;
+    memcpy(file, &max_len, sizeof(int));
+    char *ptr = file + sizeof(int);
+    char piece[17];
+    for (int i = 0; i < n; i++)
+    {
+        int len;
+        if (i < 3)
+        {
+            len = sprintf(piece, "%s", i == 0 ? "<unk>" : i == 1 ? "<s>" : "</s>");
+        }
+        else if (i < 3 + 256)
+        {
+            len = sprintf(piece, "<0x%02X>", i - 3);
+        }
+        else if (i < 3 + 256 + 95)
+        {
+            len = sprintf(piece, "%c", ' ' + i - 3 - 256);
+        }
+        else
+        {
+            *seed = *seed * 1103515245 + 12345;
+            len = 2 + (*seed >> 16) % 11;
+            piece[0] = (*seed >> 8) & 1 ? ' ' : random_letter(seed);
+            for (int j = 1; j < len; j++)
+            {
+                piece[j] = random_letter(seed);
+            }
+        }
+        float score = i < 3 + 256 ? 0.0f : -(float)len - i / (float)n;
+        memcpy(ptr, &score, sizeof(float));
+        memcpy(ptr + sizeof(float), &len, sizeof(int));
+        memcpy(ptr + sizeof(float) + sizeof(int), piece, len);
+        ptr += sizeof(float) + sizeof(int) + len;
+    }
+    *size = ptr - file;
+    return file;
+}
+
+void bench_tokenizer(void)
+{
+    const int vocab_sizes[] = {512, 2048, 8192, 32000};
+    const int text_len = 1024;
+    for (int v = 0; v < sizeof(vocab_sizes) / sizeof(vocab_sizes[0]); v++)
+    {
+        int n = vocab_sizes[v];
+        unsigned int seed = 1;
+        size_t size;
+        char *file = synthetic_tokenizer(n, &seed, &size);
+        TokenIndex *sorted = malloc(n * sizeof(TokenIndex));
+        char *text = malloc(text_len + 1);
+        int *tokens = malloc((text_len + 3) * sizeof(int));
+        if (!file || !sorted || !text || !tokens)
+        {
+            ESP_LOGW(TAG, "Not enough memory for a vocabulary of %d", n);
+            free(file);
+            free(sorted);
+            free(text);
+            free(tokens);
+            continue;
+        }
+        Tokenizer tokenizer = {0}; // pack_tokenizer() leaves the decode table unset
+        int64_t start = esp_timer_get_time();
+        pack_tokenizer(&tokenizer, file, size, n);
+        ESP_LOGI(TAG, "vocab %5d  %-20s %8lld us", n, "build", esp_timer_get_time() - start);
+        free(file);
+        for (int i = 0; i < n; i++)
+        {
+            sorted[i].str = (char *)tokenizer.pieces + tokenizer.offsets[i];
+            sorted[i].id = i;
+        }
+        qsort(sorted, n, sizeof(TokenIndex), compare_str);
+        for (int i = 0; i < text_len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            text[i] = (seed >> 8) % 6 == 0 ? ' ' : random_letter(&seed);
+        }
+        text[text_len] = '\0';
+
+        // exact lookups of every token string
+        int found = 0;
+        start = esp_timer_get_time();
+        for (int i = 0; i < n; i++)
+        {
+            found += lookup_bsearch(sorted, n, sorted[i].str) >= 0;
+        }
+        int64_t bsearch_us = esp_timer_get_time() - start;
+        start = esp_timer_get_time();
+        for (int i = 0; i < n; i++)
+        {
+            found += str_lookup(&tokenizer, sorted[i].str) >= 0;
+        }
+        int64_t trie_us = esp_timer_get_time() - start;
+        ESP_LOGI(TAG, "vocab %5d  %-20s %8lld ns/lookup", n, "lookup (bsearch)", bsearch_us * 1000 / n);
+        ESP_LOGI(TAG, "vocab %5d  %-20s %8lld ns/lookup", n, "lookup (trie)", trie_us * 1000 / n);
+
+        // greedy longest match over the text, then the full BPE encode
+        int n_tokens = 0;
+        start = esp_timer_get_time();
+        for (int pos = 0; pos < text_len;)
+        {
+            int len = 1;
+            str_prefix_lookup(&tokenizer, text + pos, &len);
+            pos += len;
+            n_tokens++;
+        }
+        ESP_LOGI(TAG, "vocab %5d  %-20s %8lld us/KiB, %d tokens", n, "longest match", esp_timer_get_time() - start,
+                 n_tokens);
+        start = esp_timer_get_time();
+        encode(&tokenizer, text, 1, 0, tokens, &n_tokens, NULL);
+        ESP_LOGI(TAG, "vocab %5d  %-20s %8lld us/KiB, %d tokens", n, "encode", esp_timer_get_time() - start, n_tokens);
+        if (found != 2 * n)
+        {
+            ESP_LOGW(TAG, "%d of %d lookups failed", 2 * n - found, 2 * n);
+        }
+        free_tokenizer(&tokenizer);
+        free(sorted);
+        free(text);
+        free(tokens);
+    }
+}
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+static TaskHandle_t counted_task;
+static volatile int allocations;
+
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    // called by every allocation on every core, only count the query's
+    if (counted_task != NULL && xTaskGetCurrentTaskHandle() == counted_task)
+    {
+        allocations++;
+    }
+}
+
+static void ignore_done(float tokens_ps)
+{
+}
+#endif
+
+static void ignore_token(char *token, int len)
+{
+}
+
+void check_generate_allocations(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
+                                GenerateOptions *opts)
+{
+#ifdef CONFIG_HEAP_USE_HOOKS
+    // the first query warms up what is allocated once per task (stdio buffers,
+    // the log lock), the second one must not allocate at all
+    char prompt[] = "Once upon a time";
+    generate(transformer, tokenizer, sampler, prompt, 64, ignore_done, ignore_token, opts);
+    allocations = 0;
+    counted_task = xTaskGetCurrentTaskHandle();
+    generate(transformer, tokenizer, sampler, prompt, 64, ignore_done, ignore_token, opts);
+    counted_task = NULL;
+    if (allocations != 0)
+    {
+        ESP_LOGE(TAG, "generate() made %d allocations, expected none", allocations);
+        abort();
+    }
+    ESP_LOGI(TAG, "generate() made no allocations");
+#else
+    ESP_LOGW(TAG, "Allocation check needs CONFIG_HEAP_USE_HOOKS");
+#endif
+}
+
+static float measured_tokens_ps;
+
+static void record_tokens_ps(float tokens_ps)
+{
+    measured_tokens_ps = tokens_ps;
+}
+
+void bench_console(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, GenerateOptions *opts)
+{
+    // the same query with the text flushed to the console per token, queued
+    // for the console task, and with the console detached
+    static const char *modes[] = {"sync", "deferred", "off"};
+    ConsoleMode previous = console_get_mode();
+    char prompt[] = "Once upon a time";
+    for (int m = CONSOLE_SYNC; m <= CONSOLE_OFF; m++)
+    {
+        console_set_mode((ConsoleMode)m);
+        if (console_get_mode() != m)
+        {
+            continue;
+        }
+        generate(transformer, tokenizer, sampler, prompt, 64, record_tokens_ps, ignore_token, opts);
+        console_flush();
+        ESP_LOGI(TAG, "console %-10s %8.2f tok/s", modes[m], measured_tokens_ps);
+    }
+    console_set_mode(previous);
+    ESP_LOGI(TAG, "console dropped %zu bytes", console_dropped());
+}
@@ -0,0 +1,34 @@
+#ifndef LLM_BENCH_H
+#define LLM_BENCH_H
+
+/**
+ * Microbenchmarks, run once at boot before generation starts with
+ * CONFIG_LLM_BENCHMARKS. Results are logged. bench_sampler() and
+ * bench_tokenizer() also build on the host, see tools/host_bench.
+ */
+
+#include "llm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// per-token cost of each sampling mode as the vocabulary grows
+void bench_sampler(void);
+
+// tokenizer build time, lookups and encoding as the vocabulary grows
+void bench_tokenizer(void);
+
+// tok/s of a query with the console synchronous, deferred and detached
+void bench_console(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler, GenerateOptions* opts);
+
+// aborts unless a query through generate() with these options, after a
+// warm-up query, never calls the allocator
+void check_generate_allocations(Transformer* transformer, Tokenizer* tokenizer, Sampler* sampler,
+                                GenerateOptions* opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
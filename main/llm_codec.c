@@ -0,0 +1,171 @@
+/**
+ * Chunked checkpoint decompression, see llm_codec.h
+ */
+
+#include "llm_codec.h"
+#include "llm_alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "CODEC";
+
+int codec_read_header(FILE *file, CodecHeader *header)
+{
+    if (fread(header, sizeof(CodecHeader), 1, file) == 1 && header->magic == CODEC_MAGIC)
+    {
+        if (header->version != CODEC_VERSION)
+        {
+            ESP_LOGE(TAG, "Unsupported container version %lu", (unsigned long)header->version);
+            exit(EXIT_FAILURE);
+        }
+        return 1;
+    }
+    fseek(file, 0, SEEK_SET);
+    return 0;
+}
+
+int lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_len;
+    while (ip < iend)
+    {
+        // token: high nibble is the literal length, low nibble the match length - 4
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15)
+        {
+            unsigned b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend)
+            break; // the last sequence has literals only
+        // match: 16 bit little endian offset back into the output
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+        len = (token & 15) + 4;
+        if ((token & 15) == 15)
+        {
+            unsigned b;
+            do
+            {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(oend - op))
+            return -1;
+        const uint8_t *match = op - offset;
+        if (offset >= len)
+        {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else
+        {
+            // overlapping copy repeats the last offset bytes
+            while (len--)
+                *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+static void unshuffle4(const uint8_t *src, uint8_t *dst, size_t len)
+{
+    // src holds 4 planes: byte 0 of every float, then byte 1, ... any tail
+    // that doesn't fill a whole float is stored unshuffled at the end
+    size_t n = len / 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i * 4 + 0] = src[i];
+        dst[i * 4 + 1] = src[n + i];
+        dst[i * 4 + 2] = src[2 * n + i];
+        dst[i * 4 + 3] = src[3 * n + i];
+    }
+    memcpy(dst + n * 4, src + n * 4, len - n * 4);
+}
+
+int codec_decompress(FILE *file, const CodecHeader *header, void *dst)
+{
+    // worst case LZ4 expansion is one byte in 255 plus a few bytes of framing
+    size_t max_in = header->chunk_size + header->chunk_size / 255 + 16;
+    uint8_t *in = mem_malloc(max_in, MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    uint8_t *scratch = mem_malloc(header->chunk_size, MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    if (!in || !scratch)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        mem_free(in, MEM_SCRATCH);
+        mem_free(scratch, MEM_SCRATCH);
+        return -1;
+    }
+    int err = 0;
+    uint8_t *out = dst;
+    size_t remaining = header->raw_size;
+    for (uint32_t c = 0; c < header->n_chunks && !err; c++)
+    {
+        size_t raw = remaining < header->chunk_size ? remaining : header->chunk_size;
+        ChunkHeader ch;
+        if (fread(&ch, sizeof(ch), 1, file) != 1 || ch.size > max_in || fread(in, 1, ch.size, file) != ch.size)
+        {
+            ESP_LOGE(TAG, "Failed to read chunk %lu", (unsigned long)c);
+            err = -1;
+            break;
+        }
+        // without a filter the chunk decodes straight into the weights
+        uint8_t *target = ch.filter == FILTER_SHUFFLE4 ? scratch : out;
+        switch (ch.codec)
+        {
+        case CODEC_STORE:
+            if (ch.size != raw)
+                err = -1;
+            else
+                memcpy(target, in, raw);
+            break;
+        case CODEC_LZ4:
+            if (lz4_decompress_block(in, ch.size, target, raw) != (int)raw)
+                err = -1;
+            break;
+        default:
+            err = -1;
+        }
+        if (!err && ch.filter == FILTER_SHUFFLE4)
+        {
+            unshuffle4(scratch, out, raw);
+        }
+        if (err)
+        {
+            ESP_LOGE(TAG, "Corrupt chunk %lu", (unsigned long)c);
+        }
+        out += raw;
+        remaining -= raw;
+    }
+    if (!err && remaining != 0)
+    {
+        ESP_LOGE(TAG, "Container is missing %zu bytes", remaining);
+        err = -1;
+    }
+    mem_free(in, MEM_SCRATCH);
+    mem_free(scratch, MEM_SCRATCH);
+    return err;
+}
@@ -0,0 +1,56 @@
+#ifndef LLM_CODEC_H
+#define LLM_CODEC_H
+
+/**
+ * Compressed checkpoint container.
+ *
+ * A compressed checkpoint is the regular llama2.c checkpoint split into fixed
+ * size chunks, each stored raw or LZ4 compressed and optionally byte shuffled
+ * first (the exponent bytes of neighbouring floats compress far better when
+ * grouped together). Chunks are decompressed one at a time straight into the
+ * final weight buffer, so loading needs only a chunk sized scratch buffer.
+ * tools/compress_checkpoint.py writes these files.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CODEC_MAGIC 0x5a4d4c4c // "LLMZ"
+#define CODEC_VERSION 1
+
+typedef enum {
+    CODEC_STORE = 0, // chunk stored as is
+    CODEC_LZ4 = 1,   // LZ4 block format
+} ChunkCodec;
+
+typedef enum {
+    FILTER_NONE = 0,
+    FILTER_SHUFFLE4 = 1, // bytes split into 4 planes, one per byte of each float
+} ChunkFilter;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t raw_size;   // size of the decompressed checkpoint in bytes
+    uint32_t chunk_size; // raw bytes per chunk, the last chunk may be shorter
+    uint32_t n_chunks;
+} CodecHeader;
+
+typedef struct {
+    uint8_t codec;  // ChunkCodec
+    uint8_t filter; // ChunkFilter
+    uint16_t reserved;
+    uint32_t size; // compressed size in bytes, the payload follows
+} ChunkHeader;
+
+// reads the container header. returns 1 for a compressed checkpoint, leaving
+// the file at the first chunk, or 0 for a plain one, rewinding the file
+int codec_read_header(FILE *file, CodecHeader *header);
+// decompresses every chunk of the file into dst (header->raw_size bytes).
+// returns 0 on success
+int codec_decompress(FILE *file, const CodecHeader *header, void *dst);
+// decodes one LZ4 block. returns the number of bytes written or -1 if malformed
+int lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len);
+
+#endif
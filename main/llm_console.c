@@ -0,0 +1,154 @@
+#include "llm_console.h"
+#include "llm_alloc.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+static const char *TAG = "LLM_CONSOLE";
+
+#define CONSOLE_STACK 3072
+#define CONSOLE_PRIORITY (tskIDLE_PRIORITY + 1)
+
+// the ring, indices run freely and are masked on access. only the writer
+// moves head and only the console task moves tail
+static char *ring = NULL;
+static uint32_t ring_mask;
+static _Atomic uint32_t head;
+static _Atomic uint32_t tail;
+static _Atomic size_t dropped;
+static volatile ConsoleMode mode = CONSOLE_SYNC;
+static TaskHandle_t console_task_handle = NULL;
+
+static void console_task(void *params)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+        uint32_t h = atomic_load_explicit(&head, memory_order_acquire);
+        while (t != h)
+        {
+            // up to the end of the ring, the rest on the next pass
+            uint32_t start = t & ring_mask;
+            uint32_t n = h - t < ring_mask + 1 - start ? h - t : ring_mask + 1 - start;
+            fwrite(ring + start, 1, n, stdout);
+            t += n;
+            atomic_store_explicit(&tail, t, memory_order_release);
+            h = atomic_load_explicit(&head, memory_order_acquire);
+        }
+        fflush(stdout);
+    }
+}
+
+void console_init(size_t size)
+{
+    uint32_t capacity = 64;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+    ring = mem_malloc(capacity, MEM_CONSOLE, MEM_CAPS_DEFAULT);
+    if (!ring)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        return;
+    }
+    ring_mask = capacity - 1;
+    xTaskCreate(console_task, "Console", CONSOLE_STACK, NULL, CONSOLE_PRIORITY, &console_task_handle);
+    mode = CONSOLE_DEFERRED;
+    ESP_LOGI(TAG, "Deferred console, %lu bytes", (unsigned long)capacity);
+}
+
+void console_set_mode(ConsoleMode new_mode)
+{
+    if (new_mode == CONSOLE_DEFERRED && ring == NULL)
+    {
+        ESP_LOGW(TAG, "No console task, staying synchronous");
+        return;
+    }
+    console_flush();
+    mode = new_mode;
+}
+
+ConsoleMode console_get_mode(void)
+{
+    return mode;
+}
+
+void console_write(const char *text, int len)
+{
+    if (mode == CONSOLE_SYNC)
+    {
+        fwrite(text, 1, len, stdout);
+        fflush(stdout);
+        return;
+    }
+    if (mode == CONSOLE_OFF || len <= 0)
+    {
+        return;
+    }
+    uint32_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint32_t t = atomic_load_explicit(&tail, memory_order_acquire);
+    uint32_t space = ring_mask + 1 - (h - t);
+    uint32_t n = (uint32_t)len < space ? (uint32_t)len : space;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        ring[(h + i) & ring_mask] = text[i];
+    }
+    atomic_store_explicit(&head, h + n, memory_order_release);
+    if (n < (uint32_t)len)
+    {
+        atomic_fetch_add_explicit(&dropped, len - n, memory_order_relaxed);
+    }
+    xTaskNotifyGive(console_task_handle);
+}
+
+void console_flush(void)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    while (atomic_load_explicit(&tail, memory_order_acquire) != atomic_load_explicit(&head, memory_order_relaxed))
+    {
+        vTaskDelay(1);
+    }
+}
+
+size_t console_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void console_append(char *buf, size_t size, int *len, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    size_t offset = (size_t)*len < size ? (size_t)*len : size;
+    *len += vsnprintf(buf ? buf + offset : NULL, size - offset, fmt, args);
+    va_end(args);
+}
+
+char *console_render(ConsoleFormat format, const void *ctx)
+{
+    int len = format(ctx, NULL, 0);
+    char *text = mem_malloc(len + 1, MEM_CONSOLE, MEM_CAPS_DEFAULT);
+    if (!text)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        return NULL;
+    }
+    format(ctx, text, len + 1);
+    return text;
+}
+
+void console_free_text(char *text)
+{
+    mem_free(text, MEM_CONSOLE);
+}
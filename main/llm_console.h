@@ -0,0 +1,42 @@
+#ifndef LLM_CONSOLE_H
+#define LLM_CONSOLE_H
+
+#include <stddef.h>
+
+/**
+ * Console output of the generated text, kept off the token hot path. In the
+ * deferred mode the generating task copies each piece into a lock-free
+ * single producer, single consumer ring and a low priority task writes it to
+ * stdout, so a slow UART never stalls a forward pass. When the ring is full
+ * the text is dropped and counted rather than waited for.
+ */
+
+typedef enum {
+    CONSOLE_SYNC, // written and flushed right away, the mode until console_init()
+    CONSOLE_DEFERRED, // queued on the ring for the console task
+    CONSOLE_OFF, // dropped, the console is detached
+} ConsoleMode;
+
+// creates the ring (size is rounded up to a power of two) and the console
+// task, and switches to the deferred mode
+void console_init(size_t size);
+void console_set_mode(ConsoleMode mode);
+ConsoleMode console_get_mode(void);
+// from one task at a time, the one generating
+void console_write(const char *text, int len);
+// waits until the console task wrote everything queued so far
+void console_flush(void);
+// bytes dropped because the ring was full
+size_t console_dropped(void);
+
+// reports built with snprintf semantics: a formatter returns the length it
+// needed, whatever the size, and writes nothing when buf is NULL
+typedef int (*ConsoleFormat)(const void *ctx, char *buf, size_t size);
+// snprintf at *len, the end of what was written, adding to *len past size
+void console_append(char *buf, size_t size, int *len, const char *fmt, ...);
+// runs format twice, to size and then into a string the caller frees with
+// console_free_text(). NULL when out of memory
+char *console_render(ConsoleFormat format, const void *ctx);
+void console_free_text(char *text);
+
+#endif
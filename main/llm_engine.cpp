@@ -0,0 +1,66 @@
+#include "llm_engine.h"
+#include <utility>
+
+LlmEngine::LlmEngine(const char *checkpoint)
+{
+    // on the heap, the layer loader and the stream point into the Transformer
+    transformer_ = new Transformer();
+    build_transformer(transformer_, (char *)checkpoint);
+}
+
+LlmEngine::~LlmEngine()
+{
+    reset();
+}
+
+LlmEngine::LlmEngine(LlmEngine &&other) noexcept
+    : transformer_(std::exchange(other.transformer_, nullptr)),
+      session_(std::exchange(other.session_, Session{}))
+{
+}
+
+LlmEngine &LlmEngine::operator=(LlmEngine &&other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        transformer_ = std::exchange(other.transformer_, nullptr);
+        session_ = std::exchange(other.session_, Session{});
+    }
+    return *this;
+}
+
+void LlmEngine::reset()
+{
+    if (session_.arena)
+    {
+        free_session(&session_);
+    }
+    if (transformer_)
+    {
+        // stops the workers and frees the weights and the RunState
+        free_transformer(transformer_);
+        delete transformer_;
+        transformer_ = nullptr;
+    }
+}
+
+void LlmEngine::prepare(const LlmEngine *draft, int max_prompt)
+{
+    if (session_.arena)
+    {
+        free_session(&session_);
+    }
+    build_session(&session_, transformer_, draft ? draft->transformer() : nullptr, max_prompt);
+}
+
+void LlmEngine::generate(Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps,
+                         generated_complete_cb cb_done, token_flow_cb cb_token, const GenerateOptions *opts)
+{
+    GenerateOptions options = opts ? *opts : GenerateOptions{};
+    if (options.session == nullptr)
+    {
+        options.session = session();
+    }
+    ::generate(transformer_, tokenizer, sampler, prompt, steps, cb_done, cb_token, &options);
+}
@@ -0,0 +1,51 @@
+#ifndef LLM_ENGINE_H
+#define LLM_ENGINE_H
+
+extern "C"
+{
+#include "llm.h"
+}
+
+/**
+ * One model and everything that runs it: the weights, the RunState, the
+ * worker tasks with their semaphores and the buffers of a query. Engines share
+ * nothing, so several can live side by side (a draft model next to the main
+ * one, or a new checkpoint loaded while the old one still answers) and each
+ * one is torn down by its destructor. Movable, not copyable.
+ */
+class LlmEngine
+{
+public:
+    LlmEngine() = default;
+    explicit LlmEngine(const char *checkpoint);
+    ~LlmEngine();
+
+    LlmEngine(LlmEngine &&other) noexcept;
+    LlmEngine &operator=(LlmEngine &&other) noexcept;
+    LlmEngine(const LlmEngine &) = delete;
+    LlmEngine &operator=(const LlmEngine &) = delete;
+
+    explicit operator bool() const { return transformer_ != nullptr; }
+    // stays at the same address for the engine's lifetime, even when it is moved
+    Transformer *transformer() const { return transformer_; }
+    const Config &config() const { return transformer_->config; }
+    // the preallocated query buffers, null until prepare()
+    Session *session() { return session_.arena ? &session_ : nullptr; }
+
+    // sizes the query buffers for prompts of up to max_prompt bytes, with room
+    // for draft's distributions when it is given. without it every
+    // generate() allocates them
+    void prepare(const LlmEngine *draft, int max_prompt);
+
+    // generate() on this model, with the engine's session unless opts has one
+    void generate(Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps,
+                  generated_complete_cb cb_done, token_flow_cb cb_token, const GenerateOptions *opts = nullptr);
+
+private:
+    void reset();
+
+    Transformer *transformer_ = nullptr;
+    Session session_ = {};
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "llm_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "llm_console.h"
+#include "llm_alloc.h"
+
+static const char *TAG = "LLM_PROFILE";
+
+static const char *op_names[PROF_OPS] = {"load", "rms", "wq", "wk", "wv", "rope", "att",
+                                         "wo", "res", "w1", "w3", "swiglu", "w2", "cls"};
+
+Profile *profile_create(int n_layers)
+{
+    Profile *p = mem_calloc(1, sizeof(Profile), MEM_PROFILE, MEM_CAPS_DEFAULT);
+    if (p)
+    {
+        p->n_layers = n_layers;
+        p->entries = mem_calloc((n_layers + 1) * PROF_OPS, sizeof(ProfileEntry), MEM_PROFILE, MEM_CAPS_DEFAULT);
+    }
+    if (!p || !p->entries)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        mem_free(p, MEM_PROFILE);
+        return NULL;
+    }
+    return p;
+}
+
+void profile_free(Profile *p)
+{
+    if (p)
+    {
+        mem_free(p->entries, MEM_PROFILE);
+        mem_free(p, MEM_PROFILE);
+    }
+}
+
+void profile_reset(Profile *p)
+{
+    memset(p->entries, 0, (p->n_layers + 1) * PROF_OPS * sizeof(ProfileEntry));
+    p->passes = 0;
+}
+
+void profile_mark(Profile *p, int layer, ProfileOp op, uint32_t wait, uint32_t worker)
+{
+    uint32_t now = esp_cpu_get_cycle_count();
+    ProfileEntry *e = &p->entries[layer * PROF_OPS + op];
+    e->cycles += now - p->lap;
+    e->wait += wait;
+    e->worker += worker;
+    e->calls++;
+    p->lap = now;
+}
+
+const char *profile_op_name(ProfileOp op)
+{
+    return op_names[op];
+}
+
+static void append_row(char *buf, size_t size, int *len, const char *name, const uint64_t *values, uint32_t passes)
+{
+    uint64_t sum = 0;
+    console_append(buf, size, len, "%-6s", name);
+    for (int op = 0; op < PROF_OPS; op++)
+    {
+        console_append(buf, size, len, " %7llu", (unsigned long long)(values[op] / passes / 1000));
+        sum += values[op];
+    }
+    console_append(buf, size, len, " %8llu\n", (unsigned long long)(sum / passes / 1000));
+}
+
+int profile_format(const Profile *p, char *buf, size_t size)
+{
+    int len = 0;
+    uint32_t passes = p->passes > 0 ? p->passes : 1;
+    console_append(buf, size, &len, "kcycles per forward pass, %lu passes\n%-6s", (unsigned long)p->passes, "layer");
+    for (int op = 0; op < PROF_OPS; op++)
+    {
+        console_append(buf, size, &len, " %7s", op_names[op]);
+    }
+    console_append(buf, size, &len, " %8s\n", "sum");
+
+    uint64_t total[PROF_OPS] = {0};
+    uint64_t wait[PROF_OPS] = {0};
+    uint64_t worker[PROF_OPS] = {0};
+    for (int l = 0; l <= p->n_layers; l++)
+    {
+        uint64_t row[PROF_OPS];
+        for (int op = 0; op < PROF_OPS; op++)
+        {
+            const ProfileEntry *e = &p->entries[l * PROF_OPS + op];
+            row[op] = e->cycles;
+            total[op] += e->cycles;
+            wait[op] += e->wait;
+            worker[op] += e->worker;
+        }
+        char name[8] = "out";
+        if (l < p->n_layers)
+        {
+            snprintf(name, sizeof(name), "%d", l);
+        }
+        append_row(buf, size, &len, name, row, passes);
+    }
+    append_row(buf, size, &len, "total", total, passes);
+    // of the total, the first core waiting on the second, then the second core's work
+    append_row(buf, size, &len, "wait", wait, passes);
+    append_row(buf, size, &len, "core1", worker, passes);
+    return len;
+}
+
+static int format_profile(const void *ctx, char *buf, size_t size)
+{
+    return profile_format(ctx, buf, size);
+}
+
+void profile_log(const Profile *p)
+{
+    char *text = console_render(format_profile, p);
+    if (!text)
+    {
+        return;
+    }
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        ESP_LOGI(TAG, "%s", line);
+    }
+    console_free_text(text);
+}
@@ -0,0 +1,70 @@
+#ifndef LLM_PROFILE_H
+#define LLM_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_cpu.h"
+
+/**
+ * Cycle counts of each op of the forward pass, per layer, enabled with
+ * CONFIG_LLM_PROFILE. Each op is timed on the calling core from the end of
+ * the previous one, and the time that core spent waiting for the second one
+ * is kept apart, next to the second core's own busy time. A board bound by
+ * compute shows matmuls with little wait, a PSRAM or flash bound one shows
+ * long loads and matmuls far above their arithmetic, an unbalanced split
+ * shows up as wait.
+ */
+
+typedef enum {
+    PROF_LOAD, // the layer's weights, waiting on the loader when streaming
+    PROF_RMSNORM,
+    PROF_WQ,
+    PROF_WK,
+    PROF_WV,
+    PROF_ROPE,
+    PROF_ATTENTION,
+    PROF_WO,
+    PROF_RESIDUAL,
+    PROF_W1,
+    PROF_W3,
+    PROF_SWIGLU,
+    PROF_W2,
+    PROF_CLASSIFIER,
+    PROF_OPS,
+} ProfileOp;
+
+typedef struct {
+    uint64_t cycles; // on the calling core
+    uint64_t wait; // part of cycles spent waiting for the second core
+    uint64_t worker; // the second core's busy time on its share
+    uint32_t calls;
+} ProfileEntry;
+
+typedef struct Profile {
+    int n_layers;
+    ProfileEntry* entries; // (n_layers + 1, PROF_OPS), the last row is what runs after the layers
+    uint32_t lap; // cycle count where the next op started
+    uint32_t passes; // forward passes since the last reset
+} Profile;
+
+Profile* profile_create(int n_layers);
+void profile_free(Profile* p);
+void profile_reset(Profile* p);
+
+static inline void profile_start(Profile* p)
+{
+    p->lap = esp_cpu_get_cycle_count();
+    p->passes++;
+}
+
+// charges the cycles since the previous op to op of layer (n_layers for the classifier)
+void profile_mark(Profile* p, int layer, ProfileOp op, uint32_t wait, uint32_t worker);
+
+// short name of the op, as in the table
+const char* profile_op_name(ProfileOp op);
+// the table of cycles per forward pass of each op and layer, as text. returns
+// the length it needed, like snprintf
+int profile_format(const Profile* p, char* buf, size_t size);
+void profile_log(const Profile* p);
+
+#endif
@@ -0,0 +1,138 @@
+#include "llm_service.h"
+#include "esp_log.h"
+
+static const char *TAG = "LLM_SERVICE";
+
+#define SERVICE_START_BIT (1 << 0) // a generation was requested
+#define SERVICE_DATA_BIT (1 << 1)  // text was sent since the reader last looked
+#define SERVICE_DONE_BIT (1 << 2)  // nothing is running, set after the last piece was sent
+#define SERVICE_STACK 16384
+#define SERVICE_PRIORITY 5
+#define SERVICE_SEND_SLICE_MS 20 // how often a full stream looks at cancel()
+
+// generate()'s callbacks have no context argument, they run on the service's task
+static thread_local LlmService *current_service = nullptr;
+
+LlmService::LlmService(LlmEngine *engine, Tokenizer *tokenizer, Sampler *sampler, size_t stream_size)
+    : engine_(engine), tokenizer_(tokenizer), sampler_(sampler)
+{
+    stream_ = xStreamBufferCreate(stream_size, 1);
+    events_ = xEventGroupCreate();
+    if (!stream_ || !events_)
+    {
+        ESP_LOGE(TAG, "Failed to create the token stream");
+        abort();
+    }
+    xEventGroupSetBits(events_, SERVICE_DONE_BIT);
+    xTaskCreate(task, "LlmService", SERVICE_STACK, this, SERVICE_PRIORITY, &task_);
+}
+
+LlmService::~LlmService()
+{
+    cancel();
+    wait(portMAX_DELAY);
+    vTaskDelete(task_);
+    vStreamBufferDelete(stream_);
+    vEventGroupDelete(events_);
+}
+
+void LlmService::task(void *params)
+{
+    LlmService *service = (LlmService *)params;
+    current_service = service;
+    for (;;)
+    {
+        xEventGroupWaitBits(service->events_, SERVICE_START_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
+        service->engine_->generate(service->tokenizer_, service->sampler_, service->prompt_, service->steps_,
+                                   on_done, on_token, &service->options_);
+        service->result_.cancelled = service->cancel_ != 0;
+        xEventGroupSetBits(service->events_, SERVICE_DONE_BIT);
+    }
+}
+
+void LlmService::on_token(char *piece, int len)
+{
+    // waits while the stream is full, so a slow reader holds the generation
+    // back instead of losing text. cancel() still gets through
+    LlmService *service = current_service;
+    int sent = 0;
+    while (sent < len && !service->cancel_)
+    {
+        sent += xStreamBufferSend(service->stream_, piece + sent, len - sent, pdMS_TO_TICKS(SERVICE_SEND_SLICE_MS));
+    }
+    if (sent > 0)
+    {
+        xEventGroupSetBits(service->events_, SERVICE_DATA_BIT);
+    }
+}
+
+void LlmService::on_done(float tokens_ps)
+{
+    current_service->result_.tokens_ps = tokens_ps;
+}
+
+bool LlmService::start(char *prompt, int steps, const GenerateOptions *opts)
+{
+    if (!(xEventGroupGetBits(events_) & SERVICE_DONE_BIT))
+    {
+        ESP_LOGW(TAG, "A generation is already running");
+        return false;
+    }
+    // whatever the reader left of the previous generation
+    xStreamBufferReset(stream_);
+    prompt_ = prompt;
+    steps_ = steps;
+    options_ = opts ? *opts : GenerateOptions{};
+    options_.cancel = &cancel_;
+    options_.metrics = &result_.metrics;
+    cancel_ = 0;
+    result_ = {};
+    xEventGroupClearBits(events_, SERVICE_DONE_BIT | SERVICE_DATA_BIT);
+    xEventGroupSetBits(events_, SERVICE_START_BIT);
+    return true;
+}
+
+void LlmService::cancel()
+{
+    cancel_ = 1;
+}
+
+size_t LlmService::read(char *buffer, size_t size, TickType_t timeout)
+{
+    for (;;)
+    {
+        // done is read before the stream: everything sent before it was set
+        // is in the stream by then, so an empty stream after done is the end
+        xEventGroupClearBits(events_, SERVICE_DATA_BIT);
+        bool done = xEventGroupGetBits(events_) & SERVICE_DONE_BIT;
+        size_t n = xStreamBufferReceive(stream_, buffer, size, 0);
+        if (n > 0 || done || timeout == 0)
+        {
+            return n;
+        }
+        EventBits_t bits = xEventGroupWaitBits(events_, SERVICE_DATA_BIT | SERVICE_DONE_BIT, pdFALSE, pdFALSE, timeout);
+        if (!(bits & (SERVICE_DATA_BIT | SERVICE_DONE_BIT)))
+        {
+            return 0;
+        }
+    }
+}
+
+bool LlmService::finished()
+{
+    return (xEventGroupGetBits(events_) & SERVICE_DONE_BIT) && xStreamBufferBytesAvailable(stream_) == 0;
+}
+
+bool LlmService::wait(TickType_t timeout, GenerationResult *result)
+{
+    EventBits_t bits = xEventGroupWaitBits(events_, SERVICE_DONE_BIT, pdFALSE, pdTRUE, timeout);
+    if (!(bits & SERVICE_DONE_BIT))
+    {
+        return false;
+    }
+    if (result)
+    {
+        *result = result_;
+    }
+    return true;
+}
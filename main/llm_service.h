@@ -0,0 +1,65 @@
+#ifndef LLM_SERVICE_H
+#define LLM_SERVICE_H
+
+#include "llm_engine.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/stream_buffer.h"
+
+struct GenerationResult
+{
+    float tokens_ps;
+    bool cancelled; // stopped by cancel() before steps or a stop sequence
+    GenerationMetrics metrics;
+};
+
+/**
+ * Runs generate() on its own task and publishes the text to a stream buffer
+ * as it is decoded. There is one reader: the UI or a network client reads
+ * the pieces as they appear, blocking or not, and waits on the completion
+ * instead of polling a flag. The service keeps pointers to the engine,
+ * tokenizer and sampler, and to the prompt of a running generation.
+ */
+class LlmService
+{
+public:
+    LlmService(LlmEngine *engine, Tokenizer *tokenizer, Sampler *sampler, size_t stream_size = 512);
+    ~LlmService();
+
+    // the task keeps a pointer to the service
+    LlmService(const LlmService &) = delete;
+    LlmService &operator=(const LlmService &) = delete;
+
+    // starts generating on the service's task, false while a generation runs
+    bool start(char *prompt, int steps, const GenerateOptions *opts = nullptr);
+    // stops the running generation before its next forward pass
+    void cancel();
+
+    // up to size bytes of generated text, not null terminated. waits up to
+    // timeout for some (0 never blocks, portMAX_DELAY until there is text or
+    // the generation ends) and returns 0 if none came
+    size_t read(char *buffer, size_t size, TickType_t timeout);
+    // the generation ended and every byte of it was read
+    bool finished();
+    // waits up to timeout for the generation to end, true and its result if it did
+    bool wait(TickType_t timeout, GenerationResult *result = nullptr);
+
+private:
+    static void task(void *params);
+    static void on_token(char *piece, int len);
+    static void on_done(float tokens_ps);
+
+    LlmEngine *engine_;
+    Tokenizer *tokenizer_;
+    Sampler *sampler_;
+    char *prompt_ = nullptr;
+    int steps_ = 0;
+    GenerateOptions options_ = {};
+    volatile int cancel_ = 0;
+    GenerationResult result_ = {};
+    StreamBufferHandle_t stream_;
+    EventGroupHandle_t events_;
+    TaskHandle_t task_ = nullptr;
+};
+
+#endif
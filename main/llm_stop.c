@@ -0,0 +1,134 @@
+#include "llm_stop.h"
+#include "llm_alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "LLM_STOP";
+
+static int find_child(StopMatcher *m, int node, uint8_t byte)
+{
+    for (int c = m->nodes[node].child; c != -1; c = m->nodes[c].sibling)
+    {
+        if (m->nodes[c].byte == byte)
+        {
+            return c;
+        }
+    }
+    return -1;
+}
+
+int stop_matcher_build(StopMatcher *m, const char *const *patterns, int n)
+{
+    // one node per pattern byte at most, plus the root
+    size_t capacity = 1;
+    for (int i = 0; i < n; i++)
+    {
+        capacity += strlen(patterns[i]);
+    }
+    if (capacity > INT16_MAX)
+    {
+        ESP_LOGE(TAG, "Stop sequences are too long");
+        return -1;
+    }
+    m->nodes = mem_malloc(capacity * sizeof(StopNode), MEM_STOP_MATCHER, MEM_CAPS_DEFAULT);
+    int *queue = mem_malloc(capacity * sizeof(int), MEM_SCRATCH, MEM_CAPS_DEFAULT);
+    if (m->nodes == NULL || queue == NULL)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        mem_free(m->nodes, MEM_STOP_MATCHER);
+        mem_free(queue, MEM_SCRATCH);
+        m->nodes = NULL;
+        return -1;
+    }
+    m->nodes[0] = (StopNode){0, -1, -1, 0, 0};
+    m->n_nodes = 1;
+    m->state = 0;
+
+    // the trie of all patterns
+    for (int i = 0; i < n; i++)
+    {
+        int node = 0;
+        int len = strlen(patterns[i]);
+        for (int j = 0; j < len; j++)
+        {
+            uint8_t byte = patterns[i][j];
+            int child = find_child(m, node, byte);
+            if (child == -1)
+            {
+                child = m->n_nodes++;
+                m->nodes[child] = (StopNode){byte, -1, m->nodes[node].child, 0, 0};
+                m->nodes[node].child = child;
+            }
+            node = child;
+        }
+        if (len > 0)
+        {
+            m->nodes[node].match = len;
+        }
+    }
+
+    // fail links, breadth first so a node's fail target is always done before it
+    int head = 0;
+    int tail = 0;
+    for (int c = m->nodes[0].child; c != -1; c = m->nodes[c].sibling)
+    {
+        queue[tail++] = c;
+    }
+    while (head < tail)
+    {
+        int node = queue[head++];
+        for (int c = m->nodes[node].child; c != -1; c = m->nodes[c].sibling)
+        {
+            int f = m->nodes[node].fail;
+            int target = find_child(m, f, m->nodes[c].byte);
+            while (target == -1 && f != 0)
+            {
+                f = m->nodes[f].fail;
+                target = find_child(m, f, m->nodes[c].byte);
+            }
+            m->nodes[c].fail = target == -1 ? 0 : target;
+            if (m->nodes[c].match == 0)
+            {
+                // a shorter pattern may end inside this one
+                m->nodes[c].match = m->nodes[m->nodes[c].fail].match;
+            }
+            queue[tail++] = c;
+        }
+    }
+    mem_free(queue, MEM_SCRATCH);
+    ESP_LOGI(TAG, "%d stop sequences, %d states", n, m->n_nodes);
+    return 0;
+}
+
+void stop_matcher_reset(StopMatcher *m)
+{
+    m->state = 0;
+}
+
+int stop_matcher_feed(StopMatcher *m, const char *text)
+{
+    for (int i = 0; text[i] != '\0'; i++)
+    {
+        uint8_t byte = text[i];
+        int next = find_child(m, m->state, byte);
+        while (next == -1 && m->state != 0)
+        {
+            m->state = m->nodes[m->state].fail;
+            next = find_child(m, m->state, byte);
+        }
+        m->state = next == -1 ? 0 : next;
+        if (m->nodes[m->state].match)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+void stop_matcher_free(StopMatcher *m)
+{
+    mem_free(m->nodes, MEM_STOP_MATCHER);
+    m->nodes = NULL;
+    m->n_nodes = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LLM_STOP_H
+#define LLM_STOP_H
+
+/**
+ * Stop sequences for generate(), matched incrementally over the decoded
+ * output with an Aho-Corasick automaton. Every byte advances the automaton
+ * once (amortized), so checking costs the same however many stop sequences
+ * there are and however they straddle token boundaries.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t byte; // byte on the edge from the parent
+    int16_t child; // first child, -1 if none
+    int16_t sibling; // next child of the same parent, -1 if none
+    int16_t fail; // longest proper suffix that is also a prefix of some pattern
+    int16_t match; // length of a pattern ending here (directly or via fail links), 0 if none
+} StopNode;
+
+typedef struct {
+    StopNode* nodes; // the trie, node 0 is the root
+    int n_nodes;
+    int state; // current node, carried across feeds
+} StopMatcher;
+
+// builds the automaton for n stop strings. returns 0 on success
+int stop_matcher_build(StopMatcher* m, const char* const* patterns, int n);
+// forgets the bytes fed so far, call before each generation
+void stop_matcher_reset(StopMatcher* m);
+// feeds decoded text. returns the number of bytes of text up to the end of
+// the first stop sequence completed, or 0 if none was
+int stop_matcher_feed(StopMatcher* m, const char* text);
+void stop_matcher_free(StopMatcher* m);
+
+#endif
@@ -27,8 +27,15 @@ extern "C"
 {
 #include "llama.h"
 #include "llm.h"
+#include "llm_alloc.h"
+#include "llm_bench.h"
+#include "llm_console.h"
+#include "metrics_server.h"
+#include "voice_trace.h"
 #include "wifi_manager.h" // Add this
 }
+#include "llm_engine.h"
+#include "llm_service.h"
 
 static const char *TAG = "MAIN";
 
@@ -65,7 +72,6 @@ static char upload_url[512];
 
 // Scroll state
 static int scroll_position = 0;
-static bool generation_complete = false;
 
 // Font 5x7
 const uint8_t font5x7[][5] = {
@@ -379,6 +385,8 @@ static uint32_t fast_rand32(void)
 // --- Drop-in replacement for your oled_show_animation ---
 void oled_show_animation(const char *message)
 {
+    // callers pass literals, the trace keeps the pointer
+    TraceId span = trace_begin("display", message);
 
     char msg[32];
     strncpy(msg, message, sizeof(msg) - 1);
@@ -484,6 +492,7 @@ void oled_show_animation(const char *message)
     oled_clear();
     oled_draw_string(final_x, 4, msg);
     vTaskDelay(pdMS_TO_TICKS(200));
+    trace_end(span, 0);
 }
 
 // === WIFI FUNCTIONS ===
@@ -539,11 +548,58 @@ void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id
 //     ESP_LOGI(TAG, "WiFi initialized");
 // }
 
+// === REQUEST TRACING ===
+
+// closes a span when it goes out of scope, for functions with several returns
+struct TraceScope
+{
+    TraceId id;
+    int32_t value = 0;
+    TraceScope(const char *category, const char *name) : id(trace_begin(category, name)) {}
+    ~TraceScope() { end(); }
+    void end()
+    {
+        if (id != 0)
+        {
+            trace_end(id, value);
+            id = 0;
+        }
+    }
+};
+
+// connecting covers DNS, TCP and the TLS handshake
+static esp_err_t traced_open(esp_http_client_handle_t client, int write_len)
+{
+    TraceId span = trace_begin("http", "connect+tls");
+    esp_err_t err = esp_http_client_open(client, write_len);
+    trace_end(span, err);
+    if (err != ESP_OK)
+    {
+        metrics_count(METRIC_HTTP_ERRORS);
+    }
+    return err;
+}
+
+// from the end of the body to the response headers, the server's time
+static int traced_fetch_headers(esp_http_client_handle_t client)
+{
+    TraceId span = trace_begin("http", "wait response");
+    int content_length = esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    trace_end(span, status_code);
+    if (content_length < 0 || status_code >= 400)
+    {
+        metrics_count(METRIC_HTTP_ERRORS);
+    }
+    return content_length;
+}
+
 // === ASSEMBLYAI FUNCTIONS ===
 
 bool upload_audio_to_assemblyai(int16_t *audio, size_t len)
 {
     ESP_LOGI(TAG, "Uploading %d samples...", len);
+    TraceScope request("http", "upload request");
 
     esp_http_client_config_t config = {};
     config.url = "https://api.assemblyai.com/v2/upload";
@@ -581,7 +637,7 @@ bool upload_audio_to_assemblyai(int16_t *audio, size_t len)
     memcpy(wav + 36, "data", 4);
     memcpy(wav + 40, &data_size, 4);
 
-    esp_err_t err = esp_http_client_open(client, 44 + data_size);
+    esp_err_t err = traced_open(client, 44 + data_size);
     if (err != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to open connection: %d", err);
@@ -589,11 +645,14 @@ bool upload_audio_to_assemblyai(int16_t *audio, size_t len)
         return false;
     }
 
+    TraceId send = trace_begin("http", "send");
     esp_http_client_write(client, (char *)wav, 44);
     esp_http_client_write(client, (char *)audio, data_size);
+    trace_end(send, 44 + data_size);
 
-    int content_length = esp_http_client_fetch_headers(client);
+    int content_length = traced_fetch_headers(client);
     int status_code = esp_http_client_get_status_code(client);
+    request.value = status_code;
 
     if (status_code != 200)
     {
@@ -631,6 +690,7 @@ bool request_transcription()
 {
     char body[1024];
     snprintf(body, sizeof(body), "{\"audio_url\":\"%s\"}", upload_url);
+    TraceScope request("http", "transcript request");
 
     esp_http_client_config_t config = {};
     config.url = "https://api.assemblyai.com/v2/transcript";
@@ -642,7 +702,7 @@ bool request_transcription()
     esp_http_client_set_header(client, "authorization", ASSEMBLYAI_API_KEY);
     esp_http_client_set_header(client, "Content-Type", "application/json");
 
-    esp_err_t err = esp_http_client_open(client, strlen(body));
+    esp_err_t err = traced_open(client, strlen(body));
     if (err != ESP_OK)
     {
         esp_http_client_cleanup(client);
@@ -650,8 +710,9 @@ bool request_transcription()
     }
 
     esp_http_client_write(client, body, strlen(body));
-    int content_length = esp_http_client_fetch_headers(client);
+    int content_length = traced_fetch_headers(client);
     int status_code = esp_http_client_get_status_code(client);
+    request.value = status_code;
 
     if (status_code != 200 && status_code != 201)
     {
@@ -706,6 +767,8 @@ bool get_transcription_result()
 
     for (int i = 0; i < 30; i++)
     {
+        // the request alone, the pause between polls is left out
+        TraceScope request("http", "poll request");
         esp_http_client_config_t config = {};
         config.url = url;
         config.method = HTTP_METHOD_GET;
@@ -715,15 +778,17 @@ bool get_transcription_result()
         esp_http_client_handle_t client = esp_http_client_init(&config);
         esp_http_client_set_header(client, "authorization", ASSEMBLYAI_API_KEY);
 
-        esp_err_t err = esp_http_client_open(client, 0);
+        esp_err_t err = traced_open(client, 0);
         if (err != ESP_OK)
         {
             esp_http_client_cleanup(client);
+            request.end();
             vTaskDelay(pdMS_TO_TICKS(2000));
             continue;
         }
 
-        int content_length = esp_http_client_fetch_headers(client);
+        int content_length = traced_fetch_headers(client);
+        request.value = esp_http_client_get_status_code(client);
 
         char response[4096];
         int total_read = 0;
@@ -739,6 +804,7 @@ bool get_transcription_result()
 
         response[total_read] = '\0';
         esp_http_client_cleanup(client);
+        request.end();
 
         if (strstr(response, "\"status\": \"completed\"") || strstr(response, "\"status\":\"completed\""))
         {
@@ -835,21 +901,30 @@ void init_storage()
 
 // === LLM CALLBACKS ===
 
-void generate_complete_cb(float tk_s)
+static StopMatcher stop_matcher;
+static GenerateOptions generate_options = {NULL, CONFIG_LLM_SPECULATE_TOKENS, CONFIG_LLM_LOOKUP_NGRAM};
+
+void init_stop_sequences()
 {
-    printf("\n\nSpeed: %.2f tok/s\n\n", tk_s);
-    generation_complete = true;
+    // CONFIG_LLM_STOP_SEQUENCES is a '|' separated list
+    static char list[] = CONFIG_LLM_STOP_SEQUENCES;
+    const char *patterns[16];
+    int n = 0;
+    for (char *p = strtok(list, "|"); p != NULL && n < 16; p = strtok(NULL, "|"))
+    {
+        patterns[n++] = p;
+    }
+    if (n > 0 && stop_matcher_build(&stop_matcher, patterns, n) == 0)
+    {
+        generate_options.stop = &stop_matcher;
+    }
 }
 
-void output_cb(char *token)
+void append_output(const char *token, int token_len)
 {
-    printf("%s", token);
-    fflush(stdout);
-
-    int token_len = strlen(token);
     if (output_pos + token_len < OUTPUT_BUFFER_SIZE - 1)
     {
-        strncpy(output_buffer + output_pos, token, OUTPUT_BUFFER_SIZE - output_pos - 1);
+        memcpy(output_buffer + output_pos, token, token_len);
         output_pos += token_len;
         output_buffer[output_pos] = '\0';
     }
@@ -886,7 +961,7 @@ void removePunctuationInPlace(char *text)
 }
 
 // === VOICE ASSISTANT ===
-void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler)
+void voice_assistant_mode(LlmService *service)
 {
     ESP_LOGI(TAG, "Voice assistant mode");
 
@@ -913,6 +988,7 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
     oled_draw_string(0, 3, "RECORDING...");
     vTaskDelay(pdMS_TO_TICKS(20));
 
+    TraceId record = trace_begin("voice", "record");
     size_t bytes_read = 0, total = 0;
     int32_t temp[1024];
 
@@ -926,6 +1002,11 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
         }
     }
 
+    trace_end(record, total);
+    // what users wait for: from letting go of the button to the answer on
+    // screen, or to the error message with a value of -1
+    TraceId response = trace_begin("voice", "response");
+
     ESP_LOGI(TAG, "Recorded %d samples", total);
 
     if (total > SAMPLE_RATE)
@@ -940,16 +1021,26 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
             vTaskDelay(pdMS_TO_TICKS(3000));
         }
 
-        if (upload_audio_to_assemblyai(audio_buffer, total))
+        TraceId stt = trace_begin("stt", "upload");
+        bool uploaded = upload_audio_to_assemblyai(audio_buffer, total);
+        trace_end(stt, uploaded);
+        if (uploaded)
         {
             oled_show_animation("TRANSCRIBING");
 
-            if (request_transcription())
+            stt = trace_begin("stt", "request");
+            bool requested = request_transcription();
+            trace_end(stt, requested);
+            if (requested)
             {
                 oled_show_animation("PROCESSING");
 
-                if (get_transcription_result())
+                stt = trace_begin("stt", "poll");
+                bool transcribed = get_transcription_result();
+                trace_end(stt, transcribed);
+                if (transcribed)
                 {
+                    TraceId shown = trace_begin("display", "transcript");
                     oled_clear();
                     vTaskDelay(pdMS_TO_TICKS(20));
                     oled_draw_string(0, 0, "YOU SAID:");
@@ -974,47 +1065,76 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
                     }
 
                     vTaskDelay(pdMS_TO_TICKS(3000));
+                    trace_end(shown, len);
 
                     oled_show_animation("THINKING");
 
                     output_pos = 0;
                     output_buffer[0] = '\0';
-                    generation_complete = false;
 
                     removePunctuationInPlace(transcribed_text);
-                    generate(transformer, tokenizer, sampler, transcribed_text, 128, &generate_complete_cb, &output_cb);
+                    TraceId think = trace_begin("llm", "generate");
+                    service->start(transcribed_text, 128, &generate_options);
 
-                    while (!generation_complete)
+                    // the text arrives as it is decoded, read until the generation ends
+                    char piece[64];
+                    bool first_text = true;
+                    while (!service->finished())
                     {
-                        vTaskDelay(pdMS_TO_TICKS(100));
+                        size_t n = service->read(piece, sizeof(piece), portMAX_DELAY);
+                        if (n > 0 && first_text)
+                        {
+                            trace_instant("llm", "first text");
+                            first_text = false;
+                        }
+                        append_output(piece, n);
                     }
+                    GenerationResult result;
+                    service->wait(portMAX_DELAY, &result);
+                    trace_end(think, result.metrics.generated_tokens);
+                    metrics_record_generation(&result.metrics, result.tokens_ps);
+                    printf("\n\nSpeed: %.2f tok/s, first token %lld ms, token latency p99 %lld ms\n\n", result.tokens_ps,
+                           result.metrics.ttft_us / 1000, result.metrics.itl_p99_us / 1000);
 
                     vTaskDelay(pdMS_TO_TICKS(500));
+                    trace_end(response, output_pos);
+                    ESP_LOGI(TAG, "Button release to answer on screen: %lld ms",
+                             trace_duration(response) / 1000);
+#ifdef CONFIG_VOICE_TRACE_DUMP
+                    console_flush();
+                    trace_dump();
+#endif
                     oled_display_scrolling_text(output_buffer);
                     vTaskDelay(pdMS_TO_TICKS(1000));
                 }
                 else
                 {
+                    metrics_count(METRIC_STT_ERRORS);
                     oled_clear();
                     vTaskDelay(pdMS_TO_TICKS(20));
                     oled_draw_string(0, 3, "TRANS FAILED");
+                    trace_end(response, -1);
                     vTaskDelay(pdMS_TO_TICKS(2000));
                 }
             }
             else
             {
+                metrics_count(METRIC_STT_ERRORS);
                 oled_clear();
                 vTaskDelay(pdMS_TO_TICKS(20));
                 oled_draw_string(0, 3, "REQ FAILED");
+                trace_end(response, -1);
                 vTaskDelay(pdMS_TO_TICKS(2000));
             }
         }
         else
         {
+            metrics_count(METRIC_STT_ERRORS);
             oled_clear();
             vTaskDelay(pdMS_TO_TICKS(20));
             oled_draw_string(0, 3, "UPLOAD FAILED");
             oled_draw_string(0, 5, "CHECK WIFI");
+            trace_end(response, -1);
             vTaskDelay(pdMS_TO_TICKS(3000));
         }
     }
@@ -1025,6 +1145,7 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
         char msg[32];
         snprintf(msg, sizeof(msg), "TOO SHORT:%d", total);
         oled_draw_string(0, 3, msg);
+        trace_end(response, -1);
         vTaskDelay(pdMS_TO_TICKS(2000));
     }
 
@@ -1032,7 +1153,7 @@ void voice_assistant_mode(Transformer *transformer, Tokenizer *tokenizer, Sample
     vTaskDelay(pdMS_TO_TICKS(200));
 }
 
-void waveform_loop(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler)
+void waveform_loop(LlmService *service)
 {
     static bool last_button_state = true;
     static uint32_t last_press_time = 0;
@@ -1051,7 +1172,7 @@ void waveform_loop(Transformer *transformer, Tokenizer *tokenizer, Sampler *samp
         {
             last_press_time = now;
             vTaskDelay(pdMS_TO_TICKS(100));
-            voice_assistant_mode(transformer, tokenizer, sampler);
+            voice_assistant_mode(service);
 
             // Show ready screen again
             oled_clear();
@@ -1071,9 +1192,7 @@ void waveform_loop(Transformer *transformer, Tokenizer *tokenizer, Sampler *samp
 
 struct VoiceTaskParams
 {
-    Transformer *transformer;
-    Tokenizer *tokenizer;
-    Sampler *sampler;
+    LlmService *service;
 };
 
 void voice_task(void *params)
@@ -1088,6 +1207,9 @@ void voice_task(void *params)
     if (wifi_status == ESP_OK)
     {
         ESP_LOGI(TAG, "Connected to WiFi, continuing with main app");
+#ifdef CONFIG_METRICS_SERVER
+        metrics_server_start();
+#endif
     }
     else
     {
@@ -1110,7 +1232,7 @@ void voice_task(void *params)
     oled_show_animation("I2S INIT");
     init_i2s_microphone();
 
-    waveform_loop(data->transformer, data->tokenizer, data->sampler);
+    waveform_loop(data->service);
 }
 
 // === MAIN ===
@@ -1135,15 +1257,46 @@ extern "C" void app_main()
     oled_show_animation("LOADING");
     init_storage();
 
-    static Transformer transformer;
+    // the generated text is echoed by a low priority task, never by the one generating
+    console_init(1024);
+
     oled_show_animation("LOAD LLM");
-    build_transformer(&transformer, (char *)"/data/stories260K.bin");
+    static LlmEngine engine("/data/stories260K.bin");
+
+    // each engine has its own workers, the draft model runs next to the main one
+    static LlmEngine draft_engine;
+    if (strlen(CONFIG_LLM_DRAFT_CHECKPOINT) > 0)
+    {
+        draft_engine = LlmEngine(CONFIG_LLM_DRAFT_CHECKPOINT);
+        generate_options.draft = draft_engine.transformer();
+    }
 
     static Tokenizer tokenizer;
-    build_tokenizer(&tokenizer, (char *)"/data/tok512.bin", transformer.config.vocab_size);
+    build_tokenizer(&tokenizer, (char *)"/data/tok512.bin", engine.config().vocab_size);
 
     static Sampler sampler;
-    build_sampler(&sampler, transformer.config.vocab_size, 0.0f, 0.9f, (unsigned int)time(NULL));
+    build_sampler(&sampler, engine.config().vocab_size, 0.0f, 0.9f, (unsigned int)time(NULL));
+#if CONFIG_LLM_PENALTY_WINDOW > 0
+    sampler_set_penalties(&sampler, CONFIG_LLM_REPETITION_PENALTY / 100.0f, CONFIG_LLM_PRESENCE_PENALTY / 100.0f,
+                          CONFIG_LLM_FREQUENCY_PENALTY / 100.0f, CONFIG_LLM_PENALTY_WINDOW);
+#endif
+    init_stop_sequences();
+    metrics_set_profile(engine.transformer()->profile);
+
+    // every buffer a query needs, allocated once for the longest transcription
+    engine.prepare(draft_engine ? &draft_engine : nullptr, sizeof(transcribed_text) - 1);
+    // what every part of the engine holds now that everything is loaded
+    mem_log_map();
+
+#ifdef CONFIG_LLM_BENCHMARKS
+    oled_show_animation("BENCH");
+    bench_sampler();
+    bench_tokenizer();
+    GenerateOptions check_options = generate_options;
+    check_options.session = engine.session();
+    bench_console(engine.transformer(), &tokenizer, &sampler, &check_options);
+    check_generate_allocations(engine.transformer(), &tokenizer, &sampler, &check_options);
+#endif
 
     oled_clear();
     vTaskDelay(pdMS_TO_TICKS(20));
@@ -1152,7 +1305,9 @@ extern "C" void app_main()
 
     ESP_LOGI(TAG, "Ready for voice input");
 
-    static VoiceTaskParams params = {&transformer, &tokenizer, &sampler};
+    // generation runs on the service's task, the voice task only reads the text
+    static LlmService service(&engine, &tokenizer, &sampler);
+    static VoiceTaskParams params = {&service};
 
     xTaskCreate(voice_task, "voice_task", 16384, &params, 5, NULL);
 
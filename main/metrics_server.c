@@ -0,0 +1,238 @@
+#include "metrics_server.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_http_server.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "llm_console.h"
+#include "llm_profile.h"
+#include "voice_trace.h"
+
+static const char *TAG = "METRICS";
+
+#ifndef CONFIG_METRICS_PORT
+#define CONFIG_METRICS_PORT 9100
+#endif
+#define METRICS_STACK 4096
+#define METRICS_LINE 192
+
+static httpd_handle_t server = NULL;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static _Atomic uint32_t counters[METRIC_COUNTERS];
+static GenerationMetrics last_generation;
+static float last_tokens_ps;
+static uint32_t generations;
+static uint64_t generated_tokens;
+static uint64_t latency_count; // inter token latencies of all generations
+static int64_t latency_sum_us;
+static const Profile *profile = NULL;
+
+void metrics_count(MetricCounter counter)
+{
+    atomic_fetch_add_explicit(&counters[counter], 1, memory_order_relaxed);
+}
+
+void metrics_record_generation(const GenerationMetrics *metrics, float tokens_ps)
+{
+    taskENTER_CRITICAL(&lock);
+    last_generation = *metrics;
+    last_tokens_ps = tokens_ps;
+    generations++;
+    generated_tokens += metrics->generated_tokens;
+    // one latency per token after the first, together they span the decode
+    latency_count += metrics->generated_tokens > 1 ? metrics->generated_tokens - 1 : 0;
+    latency_sum_us += metrics->decode_us;
+    taskEXIT_CRITICAL(&lock);
+}
+
+void metrics_set_profile(const Profile *p)
+{
+    profile = p;
+}
+
+static void emit(httpd_req_t *req, const char *fmt, ...)
+{
+    // one chunk per line, the page is never held in memory whole
+    char line[METRICS_LINE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    httpd_resp_send_chunk(req, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+}
+
+static void emit_header(httpd_req_t *req, const char *name, const char *type, const char *help)
+{
+    emit(req, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void emit_generation(httpd_req_t *req)
+{
+    taskENTER_CRITICAL(&lock);
+    GenerationMetrics m = last_generation;
+    float tokens_ps = last_tokens_ps;
+    uint32_t count = generations;
+    uint64_t tokens = generated_tokens;
+    uint64_t latencies = latency_count;
+    int64_t latencies_us = latency_sum_us;
+    taskEXIT_CRITICAL(&lock);
+
+    emit_header(req, "llm_generations_total", "counter", "Completed generate() calls.");
+    emit(req, "llm_generations_total %lu\n", (unsigned long)count);
+    emit_header(req, "llm_generated_tokens_total", "counter", "Tokens sampled by all generations.");
+    emit(req, "llm_generated_tokens_total %llu\n", (unsigned long long)tokens);
+    emit_header(req, "llm_tokens_per_second", "gauge", "Speed reported by the last generation.");
+    emit(req, "llm_tokens_per_second %.3f\n", tokens_ps);
+    emit_header(req, "llm_decode_tokens_per_second", "gauge", "Decode rate after the first token, last generation.");
+    emit(req, "llm_decode_tokens_per_second %.3f\n", m.decode_tok_s);
+    emit_header(req, "llm_prefill_tokens_per_second", "gauge", "Prompt processing rate, last generation.");
+    emit(req, "llm_prefill_tokens_per_second %.3f\n", m.prefill_tok_s);
+    emit_header(req, "llm_prompt_tokens", "gauge", "Prompt length of the last generation.");
+    emit(req, "llm_prompt_tokens %d\n", m.prompt_tokens);
+    emit_header(req, "llm_time_to_first_token_seconds", "gauge", "From the call to the first generated token, last generation.");
+    emit(req, "llm_time_to_first_token_seconds %.6f\n", m.ttft_us / 1e6);
+    emit_header(req, "llm_prefill_seconds", "gauge", "Forward passes over the prompt, last generation.");
+    emit(req, "llm_prefill_seconds %.6f\n", m.prefill_us / 1e6);
+    emit_header(req, "llm_inter_token_latency_seconds", "summary",
+                "Inter token latency, quantiles of the last generation, sum and count of all.");
+    emit(req, "llm_inter_token_latency_seconds{quantile=\"0.5\"} %.6f\n", m.itl_p50_us / 1e6);
+    emit(req, "llm_inter_token_latency_seconds{quantile=\"0.9\"} %.6f\n", m.itl_p90_us / 1e6);
+    emit(req, "llm_inter_token_latency_seconds{quantile=\"0.99\"} %.6f\n", m.itl_p99_us / 1e6);
+    emit(req, "llm_inter_token_latency_seconds_sum %.6f\n", latencies_us / 1e6);
+    emit(req, "llm_inter_token_latency_seconds_count %llu\n", (unsigned long long)latencies);
+}
+
+static void emit_profile(httpd_req_t *req)
+{
+    const Profile *p = profile;
+    if (!p || p->passes == 0)
+    {
+        return;
+    }
+    emit_header(req, "llm_op_cycles_per_pass", "gauge", "CPU cycles of each forward op over all layers, per pass of the last generation.");
+    for (int op = 0; op < PROF_OPS; op++)
+    {
+        uint64_t cycles = 0;
+        for (int l = 0; l <= p->n_layers; l++)
+        {
+            cycles += p->entries[l * PROF_OPS + op].cycles;
+        }
+        emit(req, "llm_op_cycles_per_pass{op=\"%s\"} %llu\n", profile_op_name(op), (unsigned long long)(cycles / p->passes));
+    }
+}
+
+static void emit_heap(httpd_req_t *req)
+{
+    emit_header(req, "heap_free_bytes", "gauge", "Free heap by region.");
+    emit(req, "heap_free_bytes{region=\"internal\"} %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    emit(req, "heap_free_bytes{region=\"psram\"} %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    emit_header(req, "heap_minimum_free_bytes", "gauge", "Lowest free heap since boot by region.");
+    emit(req, "heap_minimum_free_bytes{region=\"internal\"} %u\n", (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    emit(req, "heap_minimum_free_bytes{region=\"psram\"} %u\n", (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+    emit_header(req, "heap_largest_free_block_bytes", "gauge", "Largest allocation that can succeed by region.");
+    emit(req, "heap_largest_free_block_bytes{region=\"internal\"} %u\n", (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    emit(req, "heap_largest_free_block_bytes{region=\"psram\"} %u\n", (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+}
+
+static void emit_tasks(httpd_req_t *req)
+{
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    // a few spare entries for tasks created in between
+    UBaseType_t capacity = uxTaskGetNumberOfTasks() + 4;
+    TaskStatus_t *tasks = malloc(capacity * sizeof(TaskStatus_t));
+    if (!tasks)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        return;
+    }
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t n = uxTaskGetSystemState(tasks, capacity, &total);
+    // each core accumulates its own run time, the total counts one of them
+    total *= portNUM_PROCESSORS;
+
+    emit_header(req, "freertos_task_cpu_ratio", "gauge", "Share of CPU time since boot, over all cores.");
+    for (UBaseType_t i = 0; i < n; i++)
+    {
+        emit(req, "freertos_task_cpu_ratio{task=\"%s\"} %.6f\n", tasks[i].pcTaskName,
+             total > 0 ? (double)tasks[i].ulRunTimeCounter / total : 0.0);
+    }
+    emit_header(req, "freertos_task_stack_free_bytes", "gauge", "Stack never used since the task started.");
+    for (UBaseType_t i = 0; i < n; i++)
+    {
+        // ESP-IDF counts the high-water mark in bytes
+        emit(req, "freertos_task_stack_free_bytes{task=\"%s\"} %u\n", tasks[i].pcTaskName,
+             (unsigned)tasks[i].usStackHighWaterMark);
+    }
+    free(tasks);
+#endif
+}
+
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    emit_generation(req);
+    emit_profile(req);
+    emit_heap(req);
+    emit_tasks(req);
+    emit_header(req, "http_errors_total", "counter", "HTTP requests that failed to connect or got an error status.");
+    emit(req, "http_errors_total %lu\n", (unsigned long)atomic_load(&counters[METRIC_HTTP_ERRORS]));
+    emit_header(req, "stt_errors_total", "counter", "Speech to text attempts without a transcript.");
+    emit(req, "stt_errors_total %lu\n", (unsigned long)atomic_load(&counters[METRIC_STT_ERRORS]));
+    emit_header(req, "uptime_seconds", "gauge", "Time since boot.");
+    emit(req, "uptime_seconds %lld\n", esp_timer_get_time() / 1000000);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t trace_handler(httpd_req_t *req)
+{
+    char *text = trace_render();
+    if (!text)
+    {
+        return httpd_resp_send_500(req);
+    }
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_sendstr(req, text);
+    console_free_text(text);
+    return err;
+}
+
+esp_err_t metrics_server_start(void)
+{
+    if (server)
+    {
+        return ESP_OK;
+    }
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = CONFIG_METRICS_PORT;
+    // apart from the provisioning server's control port
+    config.ctrl_port = config.ctrl_port + 1;
+    config.stack_size = METRICS_STACK;
+    config.lru_purge_enable = true;
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start the metrics server: %s", esp_err_to_name(err));
+        return err;
+    }
+    httpd_uri_t metrics_uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(server, &metrics_uri);
+    httpd_uri_t trace_uri = {
+        .uri = "/trace",
+        .method = HTTP_GET,
+        .handler = trace_handler,
+        .user_ctx = NULL,
+    };
+    httpd_register_uri_handler(server, &trace_uri);
+    ESP_LOGI(TAG, "Metrics on port %d", CONFIG_METRICS_PORT);
+    return ESP_OK;
+}
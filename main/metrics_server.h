@@ -0,0 +1,38 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include "esp_err.h"
+#include "llm.h"
+
+/**
+ * Telemetry in the Prometheus text format on GET /metrics, for a collector
+ * on the local network: the last generation's speed and latencies, the per
+ * op profile when CONFIG_LLM_PROFILE is on, heap, per task CPU share and
+ * stack high-water marks, and error counts. GET /trace returns the voice
+ * trace as Chrome trace JSON. Recording is cheap and works whether the
+ * server runs or not.
+ */
+
+typedef enum {
+    METRIC_HTTP_ERRORS, // requests that failed to connect or got an error status
+    METRIC_STT_ERRORS, // speech to text attempts that produced no transcript
+    METRIC_COUNTERS,
+} MetricCounter;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// starts the server on CONFIG_METRICS_PORT, once the station has an address
+esp_err_t metrics_server_start(void);
+
+void metrics_count(MetricCounter counter);
+void metrics_record_generation(const GenerationMetrics* metrics, float tokens_ps);
+// the op cycle counts to export, NULL for none. read while generate() may update them
+void metrics_set_profile(const Profile* profile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
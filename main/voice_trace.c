@@ -0,0 +1,157 @@
+#include "voice_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "llm_console.h"
+
+#ifndef CONFIG_VOICE_TRACE_SPANS
+#define CONFIG_VOICE_TRACE_SPANS 128
+#endif
+
+typedef struct {
+    _Atomic TraceId id; // tells the span from an older one that held the slot, 0 for none
+    const char *category;
+    const char *name;
+    char task[16];
+    uint32_t tid;
+    int64_t start_us;
+    int64_t end_us; // 0 while open
+    int32_t value;
+    int instant;
+} TraceSpan;
+
+static TraceSpan spans[CONFIG_VOICE_TRACE_SPANS];
+static _Atomic TraceId next_id = 1;
+
+static TraceSpan *open_span(const char *category, const char *name, TraceId *id)
+{
+    *id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+    TraceSpan *s = &spans[*id % CONFIG_VOICE_TRACE_SPANS];
+    // the slot is marked free while it is rewritten, so readers skip it
+    atomic_store_explicit(&s->id, 0, memory_order_relaxed);
+    s->category = category;
+    s->name = name;
+    strncpy(s->task, pcTaskGetName(NULL), sizeof(s->task) - 1);
+    s->task[sizeof(s->task) - 1] = '\0';
+    s->tid = (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle();
+    s->start_us = esp_timer_get_time();
+    s->end_us = 0;
+    s->value = 0;
+    s->instant = 0;
+    return s;
+}
+
+TraceId trace_begin(const char *category, const char *name)
+{
+    TraceId id;
+    TraceSpan *s = open_span(category, name, &id);
+    atomic_store_explicit(&s->id, id, memory_order_release);
+    return id;
+}
+
+void trace_end(TraceId id, int32_t value)
+{
+    TraceSpan *s = &spans[id % CONFIG_VOICE_TRACE_SPANS];
+    if (atomic_load_explicit(&s->id, memory_order_acquire) != id)
+    {
+        // overwritten by newer spans while it was open
+        return;
+    }
+    s->value = value;
+    s->end_us = esp_timer_get_time();
+}
+
+void trace_instant(const char *category, const char *name)
+{
+    TraceId id;
+    TraceSpan *s = open_span(category, name, &id);
+    s->end_us = s->start_us;
+    s->instant = 1;
+    atomic_store_explicit(&s->id, id, memory_order_release);
+}
+
+int64_t trace_duration(TraceId id)
+{
+    TraceSpan *s = &spans[id % CONFIG_VOICE_TRACE_SPANS];
+    if (atomic_load_explicit(&s->id, memory_order_acquire) != id || s->end_us == 0)
+    {
+        return 0;
+    }
+    return s->end_us - s->start_us;
+}
+
+typedef struct
+{
+    TraceId last;
+    int64_t until_us;
+} TraceSnapshot;
+
+static int format_spans(const void *ctx, char *buf, size_t size)
+{
+    // the spans up to last that were closed by until_us, oldest first. the
+    // ring holds the ids last - CONFIG_VOICE_TRACE_SPANS + 1 .. last
+    const TraceSnapshot *snap = ctx;
+    TraceId last = snap->last;
+    int len = 0;
+    int first = 1;
+    TraceId oldest = last >= CONFIG_VOICE_TRACE_SPANS ? last - CONFIG_VOICE_TRACE_SPANS + 1 : 1;
+    console_append(buf, size, &len, "{\"traceEvents\":[");
+    for (TraceId id = oldest; id <= last && id != 0; id++)
+    {
+        const TraceSpan *s = &spans[id % CONFIG_VOICE_TRACE_SPANS];
+        if (atomic_load_explicit(&s->id, memory_order_acquire) != id || s->end_us == 0 || s->end_us > snap->until_us)
+        {
+            continue;
+        }
+        console_append(buf, size, &len, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%lu,\"ts\":%lld,", first ? "" : ",",
+               s->name, s->category, (unsigned long)s->tid, (long long)s->start_us);
+        if (s->instant)
+        {
+            console_append(buf, size, &len, "\"ph\":\"i\",\"s\":\"t\",");
+        }
+        else
+        {
+            console_append(buf, size, &len, "\"ph\":\"X\",\"dur\":%lld,", (long long)(s->end_us - s->start_us));
+        }
+        console_append(buf, size, &len, "\"args\":{\"task\":\"%s\",\"value\":%ld}}", s->task, (long)s->value);
+        first = 0;
+    }
+    console_append(buf, size, &len, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return len;
+}
+
+static TraceSnapshot snapshot(void)
+{
+    TraceSnapshot snap = {atomic_load_explicit(&next_id, memory_order_relaxed) - 1, esp_timer_get_time()};
+    return snap;
+}
+
+int trace_format(char *buf, size_t size)
+{
+    TraceSnapshot snap = snapshot();
+    return format_spans(&snap, buf, size);
+}
+
+char *trace_render(void)
+{
+    // both passes see the same spans, those recorded in between are left out
+    TraceSnapshot snap = snapshot();
+    return console_render(format_spans, &snap);
+}
+
+void trace_dump(void)
+{
+    char *text = trace_render();
+    if (!text)
+    {
+        return;
+    }
+    printf("TRACE BEGIN\n%s", text);
+    printf("TRACE END\n");
+    fflush(stdout);
+    console_free_text(text);
+}
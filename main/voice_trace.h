@@ -0,0 +1,34 @@
+#ifndef VOICE_TRACE_H
+#define VOICE_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Spans of the voice pipeline, from the recording through the speech to text
+ * requests and the generation to the display, timed with esp_timer. The last
+ * CONFIG_VOICE_TRACE_SPANS of them are kept in a fixed ring, older ones are
+ * overwritten, and can be exported as Chrome trace JSON (chrome://tracing or
+ * ui.perfetto.dev). Any task may record spans.
+ */
+
+typedef uint32_t TraceId;
+
+// opens a span, name and category must be string literals
+TraceId trace_begin(const char *category, const char *name);
+// closes it, value shows up in the span's args (an HTTP status, a byte count)
+void trace_end(TraceId id, int32_t value);
+// a point in time, such as the first text arriving
+void trace_instant(const char *category, const char *name);
+// microseconds the span took, 0 while open or once overwritten
+int64_t trace_duration(TraceId id);
+
+// the closed spans as Chrome trace JSON, returns the length it needed like snprintf
+int trace_format(char *buf, size_t size);
+// the same in a string the caller frees with console_free_text(), NULL when
+// out of memory
+char *trace_render(void);
+// prints them on stdout between TRACE BEGIN and TRACE END lines
+void trace_dump(void);
+
+#endif
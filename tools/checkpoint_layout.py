@@ -0,0 +1,97 @@
+"""
+The layout of a llama2.c checkpoint and the extensions main/llm.c reads after
+it, shared by the tools that append extensions.
+
+The dense weights are tensor-major: embeddings, rms_att, wq, wk, wv, wo,
+rms_ffn, w1, w2, w3, rms_final, the unused freq_cis and, when it isn't shared
+with the embeddings, wcls. A tool that replaced every layer of a tensor can
+leave its dense copy out; it then takes no space in that order, and an empty
+EXT_DROPPED extension ending the file lists the dropped tensors as bits.
+"""
+
+import struct
+
+EXT_MAGIC = 0x584D4C4C  # "LLMX"
+EXT_SPARSE = 1
+EXT_LOWRANK = 2
+EXT_DROPPED = 3
+TENSORS = ["wq", "wk", "wv", "wo", "w1", "w2", "w3", "wcls"]
+EXT_HEADER = struct.Struct("<5I")  # magic, kind, tensor, layer, payload size
+
+
+def extension(kind, tensor, layer, payload):
+    return EXT_HEADER.pack(EXT_MAGIC, kind, TENSORS.index(tensor), layer, len(payload)) + payload
+
+
+class Checkpoint:
+    def __init__(self, raw):
+        dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, seq_len = struct.unpack("<7i", raw[:28])
+        self.raw = raw
+        self.n_layers = n_layers
+        self.shared = vocab_size > 0
+        vocab_size = abs(vocab_size)
+        kv_dim = dim * n_kv_heads // n_heads
+        head_size = dim // n_heads
+        self.shapes = {
+            "wq": (dim, dim), "wk": (kv_dim, dim), "wv": (kv_dim, dim), "wo": (dim, dim),
+            "w1": (hidden_dim, dim), "w2": (dim, hidden_dim), "w3": (hidden_dim, dim),
+            "wcls": (vocab_size, dim),
+        }
+        end = len(raw)
+        self.dropped = 0
+        if end >= 28 + EXT_HEADER.size:
+            magic, kind, tensors, _, size = EXT_HEADER.unpack_from(raw, end - EXT_HEADER.size)
+            if magic == EXT_MAGIC and kind == EXT_DROPPED and size == 0:
+                self.dropped = tensors
+                end -= EXT_HEADER.size
+
+        def layers(name):
+            rows, cols = self.shapes[name]
+            return (name, n_layers * rows * cols)
+
+        sections = [("embedding", vocab_size * dim), ("rms_att", n_layers * dim)]
+        sections += [layers(t) for t in ["wq", "wk", "wv", "wo"]] + [("rms_ffn", n_layers * dim)]
+        sections += [layers(t) for t in ["w1", "w2", "w3"]] + [("rms_final", dim + seq_len * head_size)]
+        sections += [("wcls", 0 if self.shared else vocab_size * dim)]
+        # (name, offset, size) in bytes of each section, in file order
+        self.sections = []
+        offset = 28
+        for name, floats in sections:
+            size = 0 if self.is_dropped(name) else 4 * floats
+            self.sections.append((name, offset, size))
+            offset += size
+        if offset > end:
+            raise ValueError("truncated checkpoint, expected at least %d bytes" % offset)
+        self.extensions = raw[offset:end]
+
+    def is_dropped(self, name):
+        return name in TENSORS and self.dropped >> TENSORS.index(name) & 1 == 1
+
+    def tensor(self, name, layer=0):
+        """The little-endian float32 bytes of one layer of a dense tensor"""
+        if self.is_dropped(name):
+            raise ValueError("the dense %s was left out of this checkpoint" % name)
+        section = "embedding" if name == "wcls" and self.shared else name
+        offset = next(o for n, o, _ in self.sections if n == section)
+        rows, cols = self.shapes[name]
+        start = offset + 4 * layer * rows * cols
+        return self.raw[start:start + 4 * rows * cols]
+
+    def write(self, path, extensions, drop=()):
+        """Writes the checkpoint with extensions appended, leaving out the
+        dense tensors in drop. Returns the new file size"""
+        dropped = self.dropped
+        for name in drop:
+            if name == "wcls" and self.shared:
+                raise ValueError("wcls is shared with the token embeddings, it can't be dropped")
+            dropped |= 1 << TENSORS.index(name)
+        out = bytearray(self.raw[:28])
+        for name, offset, size in self.sections:
+            if name not in drop:
+                out += self.raw[offset:offset + size]
+        out += self.extensions + extensions
+        if dropped:
+            out += EXT_HEADER.pack(EXT_MAGIC, EXT_DROPPED, dropped, 0, 0)
+        with open(path, "wb") as f:
+            f.write(out)
+        return len(out)
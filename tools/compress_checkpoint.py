@@ -0,0 +1,129 @@
+"""
+Compresses a llama2.c checkpoint into the chunked container read by
+main/llm_codec.c, so more (or larger) models fit in the spiffs partition.
+
+    python tools/compress_checkpoint.py data/stories260K.bin data/stories260K.binz
+
+Every chunk is stored with whichever of raw, LZ4 and byte shuffled LZ4 is
+smallest unless --codec forces one. The flash footprint of each codec is
+printed so they can be compared; boot time is logged by read_checkpoint().
+"""
+
+import argparse
+import struct
+
+CODEC_MAGIC = 0x5A4D4C4C  # "LLMZ"
+CODEC_VERSION = 1
+CODEC_STORE, CODEC_LZ4 = 0, 1
+FILTER_NONE, FILTER_SHUFFLE4 = 0, 1
+
+MIN_MATCH = 4
+LAST_LITERALS = 5  # the LZ4 block format ends with at least 5 literals
+MF_LIMIT = 12  # and the last match starts at least 12 bytes from the end
+
+
+def _lz4_length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _lz4_sequence(out, literals, offset, match_len):
+    lit = len(literals)
+    token = min(lit, 15) << 4
+    if match_len:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit >= 15:
+        _lz4_length(out, lit - 15)
+    out += literals
+    if match_len:
+        out += struct.pack("<H", offset)
+        if match_len - MIN_MATCH >= 15:
+            _lz4_length(out, match_len - MIN_MATCH - 15)
+
+
+def lz4_compress(src):
+    """Greedy LZ4 block compressor, fine for the few MB of a checkpoint"""
+    n = len(src)
+    out = bytearray()
+    table = {}
+    anchor = i = 0
+    limit = n - MF_LIMIT
+    while i < limit:
+        key = src[i:i + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = i
+        if cand is None or i - cand > 0xFFFF:
+            i += 1
+            continue
+        length = MIN_MATCH
+        max_len = n - LAST_LITERALS - i
+        while length < max_len and src[cand + length] == src[i + length]:
+            length += 1
+        _lz4_sequence(out, src[anchor:i], i - cand, length)
+        i += length
+        anchor = i
+    _lz4_sequence(out, src[anchor:], 0, 0)
+    return bytes(out)
+
+
+def shuffle4(chunk):
+    """Groups byte k of every float together, the tail is left as is"""
+    n = len(chunk) // 4
+    return b"".join(chunk[k:n * 4:4] for k in range(4)) + chunk[n * 4:]
+
+
+def encode_chunk(chunk, codec):
+    options = []
+    if codec in ("store", "best"):
+        options.append((CODEC_STORE, FILTER_NONE, chunk))
+    if codec in ("lz4", "best"):
+        options.append((CODEC_LZ4, FILTER_NONE, lz4_compress(chunk)))
+    if codec in ("shuffle-lz4", "best"):
+        options.append((CODEC_LZ4, FILTER_SHUFFLE4, lz4_compress(shuffle4(chunk))))
+    if codec != "store":
+        # never let a chunk grow, incompressible chunks are stored
+        options.append((CODEC_STORE, FILTER_NONE, chunk))
+    return min(options, key=lambda o: len(o[2]))
+
+
+def compress(raw, chunk_size, codec):
+    chunks = [raw[i:i + chunk_size] for i in range(0, len(raw), chunk_size)]
+    out = bytearray(struct.pack("<5I", CODEC_MAGIC, CODEC_VERSION, len(raw), chunk_size, len(chunks)))
+    for chunk in chunks:
+        c, f, payload = encode_chunk(chunk, codec)
+        out += struct.pack("<BBHI", c, f, 0, len(payload))
+        out += payload
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="llama2.c checkpoint")
+    parser.add_argument("output", help="compressed checkpoint")
+    parser.add_argument("--codec", choices=["store", "lz4", "shuffle-lz4", "best"], default="best")
+    parser.add_argument("--chunk-size", type=int, default=16384,
+                        help="raw bytes per chunk, also the decoder's scratch size")
+    args = parser.parse_args()
+    if args.chunk_size % 4:
+        parser.error("--chunk-size must be a multiple of 4")
+
+    with open(args.input, "rb") as f:
+        raw = f.read()
+    print("%-12s %10d bytes" % ("raw", len(raw)))
+    result = None
+    for codec in ["store", "lz4", "shuffle-lz4", "best"]:
+        if codec != args.codec and args.codec != "best":
+            continue
+        data = compress(raw, args.chunk_size, codec)
+        print("%-12s %10d bytes  %5.1f%%" % (codec, len(data), 100.0 * len(data) / len(raw)))
+        if codec == args.codec:
+            result = data
+    with open(args.output, "wb") as f:
+        f.write(result)
+
+
+if __name__ == "__main__":
+    main()
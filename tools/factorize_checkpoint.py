@@ -0,0 +1,115 @@
+"""
+Factorizes projections of a llama2.c checkpoint into low-rank U @ V pairs
+and appends them as checkpoint extensions read by main/llm.c.
+
+    python tools/factorize_checkpoint.py data/stories260K.bin data/stories260K-lowrank.bin --error 0.1
+
+Each tensor gets the smallest rank (a multiple of 4, for the SIMD dot
+product) whose truncated SVD stays within the relative Frobenius error
+budget. Tensors that wouldn't get cheaper at that rank are left dense. By
+default the dense weights stay in the file so the output still loads in
+llama2.c; --drop-dense leaves out those whose every layer was factorized.
+Check the model's output before flashing it: the error budget is per
+tensor, and the errors of all the tensors add up.
+"""
+
+import argparse
+import struct
+
+import numpy as np
+
+from checkpoint_layout import EXT_LOWRANK, TENSORS, Checkpoint, extension
+
+
+def pick_rank(s, error):
+    """Smallest multiple of 4 rank whose dropped singular values stay within the error budget"""
+    budget = error ** 2 * np.sum(s ** 2)
+    dropped = np.concatenate([np.cumsum((s ** 2)[::-1])[::-1], [0.0]])  # dropped[r]: error of rank r
+    for rank in range(4, len(s), 4):
+        if dropped[rank] <= budget:
+            return rank
+    return len(s)
+
+
+def lowrank_extension(tensor, layer, weights, rank):
+    u, s, vt = np.linalg.svd(weights.astype(np.float64), full_matrices=False)
+    # split the singular values evenly between the factors
+    root = np.sqrt(s[:rank])
+    u = (u[:, :rank] * root).astype("<f4")
+    v = (root[:, None] * vt[:rank]).astype("<f4")
+    rows, cols = weights.shape
+    approx = u.astype(np.float64) @ v
+    err = np.linalg.norm(weights - approx) / max(np.linalg.norm(weights), 1e-12)
+    payload = struct.pack("<3I", rows, cols, rank) + u.tobytes() + v.tobytes()
+    return extension(EXT_LOWRANK, tensor, layer, payload), err
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="llama2.c checkpoint")
+    parser.add_argument("output", help="checkpoint with low-rank extensions")
+    parser.add_argument("--tensors", default="w1,w2,w3,wcls",
+                        help="comma separated tensors to factorize, of %s" % ",".join(TENSORS))
+    parser.add_argument("--error", type=float, default=0.1,
+                        help="relative Frobenius error budget per tensor")
+    parser.add_argument("--rank", type=int, default=0,
+                        help="fixed rank instead of the error budget, rounded up to a multiple of 4")
+    parser.add_argument("--drop-dense", action="store_true",
+                        help="leave out the dense tensors factorized in every layer, only main/llm.c loads the result")
+    args = parser.parse_args()
+    tensors = args.tensors.split(",")
+    if any(t not in TENSORS for t in tensors):
+        parser.error("--tensors must be a subset of %s" % ",".join(TENSORS))
+    if args.rank < 0:
+        parser.error("--rank must be positive")
+    # the dot products run 4 floats at a time, other ranks take the scalar path
+    fixed_rank = (args.rank + 3) // 4 * 4
+
+    with open(args.input, "rb") as f:
+        raw = f.read()
+    ckpt = Checkpoint(raw)
+    for name in tensors:
+        if ckpt.is_dropped(name):
+            parser.error("the dense %s was already left out of the input" % name)
+
+    out = bytearray()
+    drop = []
+    dense = kept = 0
+    for name in tensors:
+        rows, cols = ckpt.shapes[name]
+        layers = [0] if name == "wcls" else range(ckpt.n_layers)
+        factorized = 0
+        for layer in layers:
+            weights = np.frombuffer(ckpt.tensor(name, layer), dtype="<f4").reshape(rows, cols).astype(np.float64)
+            # at or past this rank the factors cost as many MACs as the dense matmul
+            max_rank = rows * cols // (rows + cols)
+            if fixed_rank:
+                rank = min(fixed_rank, min(rows, cols))
+            else:
+                s = np.linalg.svd(weights, compute_uv=False)
+                rank = pick_rank(s, args.error)
+            dense += rows * cols
+            if rank >= max_rank:
+                print("%-4s layer %d: left dense" % (name, layer))
+                kept += rows * cols
+                continue
+            ext, err = lowrank_extension(name, layer, weights, rank)
+            out += ext
+            kept += rank * (rows + cols)
+            factorized += 1
+            print("%-4s layer %d: rank %d, error %.3f" % (name, layer, rank, err))
+        if args.drop_dense and factorized == len(layers):
+            if name == "wcls" and ckpt.shared:
+                print("wcls is shared with the token embeddings, kept")
+            else:
+                drop.append(name)
+        elif args.drop_dense:
+            print("%-4s kept, %d of %d layers are still dense" % (name, len(layers) - factorized, len(layers)))
+    size = ckpt.write(args.output, bytes(out), drop)
+    print("%d of %d weights kept (%.1f%%), %d bytes to %d%s"
+          % (kept, dense, 100.0 * kept / max(dense, 1), len(raw), size,
+             ", left out " + ",".join(drop) if drop else ""))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,10 @@
+#include "llm_bench.h"
+
+// the engine's microbenchmarks on the build machine, for comparing
+// algorithms without flashing. absolute numbers don't carry over to the ESP32
+int main(void)
+{
+    bench_sampler();
+    bench_tokenizer();
+    return 0;
+}
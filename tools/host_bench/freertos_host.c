@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+// the FreeRTOS and ESP-IDF calls the engine makes, on pthreads and the C heap.
+// priorities and core affinity are ignored
+
+struct HostTask
+{
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *params;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notifications;
+};
+
+struct HostSemaphore
+{
+    pthread_mutex_t lock;
+    pthread_cond_t given;
+    int available;
+};
+
+struct HostQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned char *items;
+    size_t item_size;
+    size_t length;
+    size_t head;
+    size_t count;
+};
+
+struct HostEventGroup
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EventBits_t bits;
+};
+
+static struct HostTask main_task = {.lock = PTHREAD_MUTEX_INITIALIZER, .notified = PTHREAD_COND_INITIALIZER};
+static __thread struct HostTask *current_task;
+
+static void deadline(TickType_t ticks, struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *until)
+{
+    // 0 once woken, nonzero when the ticks ran out
+    if (ticks == portMAX_DELAY)
+    {
+        return pthread_cond_wait(cond, lock);
+    }
+    return ticks == 0 ? 1 : pthread_cond_timedwait(cond, lock, until);
+}
+
+static void *task_entry(void *arg)
+{
+    struct HostTask *task = arg;
+    current_task = task;
+    task->fn(task->params);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *params,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+    struct HostTask *task = calloc(1, sizeof(struct HostTask));
+    if (!task)
+    {
+        return pdFALSE;
+    }
+    task->fn = fn;
+    task->params = params;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->notified, NULL);
+    if (created)
+    {
+        *created = task;
+    }
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0)
+    {
+        free(task);
+        return pdFALSE;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *params,
+                       UBaseType_t priority, TaskHandle_t *created)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, params, priority, created, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == current_task)
+    {
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep(ticks * portTICK_PERIOD_MS * 1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task ? current_task : &main_task;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    struct HostTask *task = xTaskGetCurrentTaskHandle();
+    struct timespec until;
+    deadline(ticks, &until);
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0 && wait(&task->notified, &task->lock, ticks, &until) == 0)
+    {
+    }
+    uint32_t value = task->notifications;
+    if (value > 0)
+    {
+        task->notifications = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    struct HostSemaphore *sem = calloc(1, sizeof(struct HostSemaphore));
+    if (sem)
+    {
+        pthread_mutex_init(&sem->lock, NULL);
+        pthread_cond_init(&sem->given, NULL);
+    }
+    return sem;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    BaseType_t ret = sem->available ? pdFALSE : pdTRUE;
+    sem->available = 1;
+    pthread_cond_signal(&sem->given);
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec until;
+    deadline(ticks, &until);
+    pthread_mutex_lock(&sem->lock);
+    while (!sem->available && wait(&sem->given, &sem->lock, ticks, &until) == 0)
+    {
+    }
+    BaseType_t ret = sem->available ? pdTRUE : pdFALSE;
+    sem->available = 0;
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    free(sem);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct HostQueue *queue = calloc(1, sizeof(struct HostQueue));
+    if (!queue)
+    {
+        return NULL;
+    }
+    queue->items = malloc((size_t)length * item_size);
+    if (!queue->items)
+    {
+        free(queue);
+        return NULL;
+    }
+    queue->item_size = item_size;
+    queue->length = length;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    struct timespec until;
+    deadline(ticks, &until);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length && wait(&queue->changed, &queue->lock, ticks, &until) == 0)
+    {
+    }
+    if (queue->count == queue->length)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+    size_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    struct timespec until;
+    deadline(ticks, &until);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && wait(&queue->changed, &queue->lock, ticks, &until) == 0)
+    {
+    }
+    if (queue->count == 0)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    free(queue->items);
+    free(queue);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct HostEventGroup *group = calloc(1, sizeof(struct HostEventGroup));
+    if (group)
+    {
+        pthread_mutex_init(&group->lock, NULL);
+        pthread_cond_init(&group->changed, NULL);
+    }
+    return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    EventBits_t now = group->bits;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return before;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks)
+{
+    struct timespec until;
+    deadline(ticks, &until);
+    pthread_mutex_lock(&group->lock);
+    for (;;)
+    {
+        EventBits_t set = group->bits & bits;
+        if (wait_for_all ? set == bits : set != 0)
+        {
+            break;
+        }
+        if (wait(&group->changed, &group->lock, ticks, &until) != 0)
+        {
+            EventBits_t now = group->bits;
+            pthread_mutex_unlock(&group->lock);
+            return now;
+        }
+    }
+    EventBits_t now = group->bits;
+    if (clear_on_exit)
+    {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    free(group);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 240000000ULL + ts.tv_nsec * 6 / 25);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    return calloc(n, size);
+}
+
+void *heap_caps_aligned_calloc(size_t alignment, size_t n, size_t size, uint32_t caps)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, n * size) != 0)
+    {
+        return NULL;
+    }
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+size_t heap_caps_get_allocated_size(void *ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return caps & MALLOC_CAP_SPIRAM ? 8 << 20 : 320 << 10;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return heap_caps_get_free_size(caps);
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    return heap_caps_get_free_size(caps);
+}
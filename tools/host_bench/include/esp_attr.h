@@ -0,0 +1,5 @@
+#pragma once
+// the host has no IRAM or external RAM, placement attributes do nothing
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define EXT_RAM_BSS_ATTR
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+// a 240 MHz cycle counter derived from the monotonic clock
+uint32_t esp_cpu_get_cycle_count(void);
@@ -0,0 +1,33 @@
+#pragma once
+#include "esp_err.h"
+
+// plain C versions of the esp-dsp kernels the engine calls
+
+static inline esp_err_t dsps_dotprod_f32_aes3(const float *src1, const float *src2, float *dest, int len)
+{
+    float acc = 0.0f;
+    for (int i = 0; i < len; i++)
+    {
+        acc += src1[i] * src2[i];
+    }
+    *dest = acc;
+    return ESP_OK;
+}
+
+static inline esp_err_t dsps_mulc_f32(const float *input, float *output, int len, float c, int step_in, int step_out)
+{
+    for (int i = 0; i < len; i++)
+    {
+        output[i * step_out] = input[i * step_in] * c;
+    }
+    return ESP_OK;
+}
+
+static inline esp_err_t dsps_addc_f32(const float *input, float *output, int len, float c, int step_in, int step_out)
+{
+    for (int i = 0; i < len; i++)
+    {
+        output[i * step_out] = input[i * step_in] + c;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdbool.h>
+
+static inline bool esp_ptr_external_ram(const void *ptr)
+{
+    (void)ptr;
+    return false;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// just enough of FreeRTOS for the engine, tasks run as pthreads (see freertos_host.c)
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t EventBits_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (ms)
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY -1
+
+// the benchmarks record from one thread, critical sections are no-ops
+typedef struct
+{
+    int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define taskENTER_CRITICAL(mux) (void)(mux)
+#define taskEXIT_CRITICAL(mux) (void)(mux)
@@ -0,0 +1,141 @@
+"""
+Packs a llama2.c tokenizer into the prebuilt image read by main/llm.c, so
+build_tokenizer() loads it with a single read and no per-token work.
+
+    python tools/pack_tokenizer.py data/tok512.bin data/tok512.bin
+
+The image holds the scores, an offset table into one pool of the token
+strings, a byte trie of the strings for lookups and the hash table of
+merges encode() uses, in that order. The loader recognizes the image by its
+header, so it can replace the original file under the same name.
+"""
+
+import argparse
+import struct
+
+TOKENIZER_MAGIC = 0x544D4C4C  # "LLMT"
+TOKENIZER_VERSION = 2
+TRIE_NO_TOKEN = 0xFFFF
+
+
+def merge_hash(pair):
+    """Same as merge_hash() in main/llm.c"""
+    pair = (pair * 2654435761) & 0xFFFFFFFF
+    return pair ^ (pair >> 16)
+
+
+def merge_slots(n_merges):
+    """Same as merge_slots() in main/llm.c"""
+    slots = 16
+    while slots < 2 * n_merges:
+        slots *= 2
+    return slots
+
+
+def read_tokenizer(raw):
+    max_token_length, = struct.unpack_from("<i", raw, 0)
+    offset = 4
+    pieces, scores = [], []
+    while offset < len(raw):
+        score, length = struct.unpack_from("<fi", raw, offset)
+        offset += 8
+        pieces.append(raw[offset:offset + length])
+        scores.append(score)
+        offset += length
+    return max_token_length, pieces, scores
+
+
+def build_trie(pieces):
+    """Same breadth first trie as build_trie() in main/llm.c"""
+    # strcmp order, ties to the lower id
+    order = sorted(range(len(pieces)), key=lambda i: (pieces[i], i))
+    strings = [pieces[i] for i in order]
+    child, token, byte = [], [], [0]
+    nodes = [(0, len(order), 0)]  # range of sorted strings under each node, and its depth
+    node = 0
+    while node < len(nodes):
+        lo, hi, depth = nodes[node]
+        child.append(len(nodes))
+        token.append(order[lo] if lo < hi and len(strings[lo]) == depth else TRIE_NO_TOKEN)
+        while lo < hi and len(strings[lo]) == depth:
+            lo += 1
+        while lo < hi:
+            end = lo + 1
+            while end < hi and strings[end][depth] == strings[lo][depth]:
+                end += 1
+            byte.append(strings[lo][depth])
+            nodes.append((lo, end, depth + 1))
+            lo = end
+        node += 1
+    child.append(len(nodes))
+    return child, token, byte
+
+
+def build_merges(pieces):
+    """Hash table of every (left, right) pair of tokens that concatenate into a token"""
+    # the lowest id of each string, which is what str_lookup() finds
+    lookup = {}
+    for i, piece in enumerate(pieces):
+        lookup.setdefault(piece, i)
+    merges = []
+    for i, piece in enumerate(pieces):
+        if len(piece) < 2 or lookup[piece] != i:
+            continue
+        for split in range(1, len(piece)):
+            left, right = lookup.get(piece[:split]), lookup.get(piece[split:])
+            if left is not None and right is not None:
+                merges.append((left << 16 | right, i))
+    slots = merge_slots(len(merges))
+    table = [(0xFFFFFFFF, -1)] * slots
+    for pair, merged in merges:
+        slot = merge_hash(pair) & (slots - 1)
+        while table[slot][1] >= 0:
+            slot = (slot + 1) & (slots - 1)
+        table[slot] = (pair, merged)
+    return table
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="llama2.c tokenizer")
+    parser.add_argument("output", help="tokenizer image")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        raw = f.read()
+    if struct.unpack_from("<I", raw, 0)[0] == TOKENIZER_MAGIC:
+        parser.error("%s is already a tokenizer image" % args.input)
+    max_token_length, pieces, scores = read_tokenizer(raw)
+    vocab_size = len(pieces)
+    if vocab_size > 0xFFFF:
+        parser.error("%d tokens don't fit the merge table" % vocab_size)
+
+    pool = bytearray()
+    offsets = []
+    for piece in pieces:
+        offsets.append(len(pool))
+        pool += piece + b"\0"
+    pool += b"\0" * (-len(pool) % 4)
+    child, token, byte = build_trie(pieces)
+    nodes = len(token)
+    merges = build_merges(pieces)
+    slots = len(merges)
+
+    out = bytearray(struct.pack("<7I", TOKENIZER_MAGIC, TOKENIZER_VERSION, vocab_size,
+                                max_token_length, slots, len(pool), nodes))
+    out += struct.pack("<%df" % vocab_size, *scores)
+    out += struct.pack("<%dI" % vocab_size, *offsets)
+    out += pool
+    out += struct.pack("<%dI" % (nodes + 1), *child)
+    out += struct.pack("<%dH" % nodes, *token) + b"\0" * (nodes * 2 % 4)
+    out += bytes(byte) + b"\0" * (-nodes % 4)
+    for pair, merged in merges:
+        out += struct.pack("<Ii", pair, merged)
+    print("%d tokens, %d trie nodes, %d merges in %d slots, %d bytes (was %d)"
+          % (vocab_size, nodes, sum(m >= 0 for _, m in merges), slots, len(out), len(raw)))
+    with open(args.output, "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+"""
+Prunes the matmul weights of a llama2.c checkpoint to 1 x block sparse rows
+and appends them as checkpoint extensions read by main/llm.c.
+
+    python tools/sparsify_checkpoint.py data/stories260K.bin data/stories260K-sparse.bin --sparsity 0.5
+
+Each row keeps the blocks with the largest L2 norm, so every row (and so each
+core's share of a matmul) ends up with the same amount of work. The sparse
+copies replace the dense weights at runtime. By default the dense weights
+stay in the file, so the output still loads in llama2.c; --drop-dense leaves
+them out, so the file shrinks and a resident model doesn't load them into RAM.
+Prune a fine-tuned checkpoint and check its quality before flashing it,
+accuracy drops quickly past 50%.
+"""
+
+import argparse
+import array
+import struct
+
+from checkpoint_layout import EXT_SPARSE, TENSORS, Checkpoint, extension
+
+LAYER_TENSORS = TENSORS[:7]
+
+
+def prune(weights, rows, cols, block, sparsity):
+    """Returns (row_ptr, block_col, values) keeping the strongest blocks of each row"""
+    blocks_per_row = cols // block
+    keep = max(1, round(blocks_per_row * (1.0 - sparsity)))
+    row_ptr, block_col, values = [0], [], array.array("f")
+    for r in range(rows):
+        row = weights[r * cols:(r + 1) * cols]
+        norms = [sum(v * v for v in row[b * block:(b + 1) * block]) for b in range(blocks_per_row)]
+        kept = sorted(sorted(range(blocks_per_row), key=lambda b: -norms[b])[:keep])
+        for b in kept:
+            block_col.append(b)
+            values.extend(row[b * block:(b + 1) * block])
+        row_ptr.append(len(block_col))
+    return row_ptr, block_col, values
+
+
+def sparse_extension(tensor, layer, rows, cols, block, pruned):
+    row_ptr, block_col, values = pruned
+    payload = bytearray(struct.pack("<4I", rows, cols, block, len(block_col)))
+    payload += struct.pack("<%dI" % len(row_ptr), *row_ptr)
+    payload += struct.pack("<%dH" % len(block_col), *block_col)
+    payload += b"\0" * (-len(payload) % 4)
+    payload += values.tobytes()
+    return extension(EXT_SPARSE, tensor, layer, bytes(payload))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="llama2.c checkpoint")
+    parser.add_argument("output", help="checkpoint with sparse extensions")
+    parser.add_argument("--tensors", default="w1,w2,w3,wo",
+                        help="comma separated tensors to prune, of %s" % ",".join(LAYER_TENSORS))
+    parser.add_argument("--sparsity", type=float, default=0.5, help="fraction of blocks removed per row")
+    parser.add_argument("--block", type=int, default=16, help="weights per block, a multiple of 4")
+    parser.add_argument("--drop-dense", action="store_true",
+                        help="leave the pruned dense tensors out, only main/llm.c loads the result")
+    args = parser.parse_args()
+    tensors = args.tensors.split(",")
+    if any(t not in LAYER_TENSORS for t in tensors):
+        parser.error("--tensors must be a subset of %s" % ",".join(LAYER_TENSORS))
+    if args.block <= 0 or args.block % 4:
+        parser.error("--block must be a positive multiple of 4")
+
+    with open(args.input, "rb") as f:
+        raw = f.read()
+    ckpt = Checkpoint(raw)
+    for name in tensors:
+        if ckpt.is_dropped(name):
+            parser.error("the dense %s was already left out of the input" % name)
+        if ckpt.shapes[name][1] % args.block:
+            parser.error("%s has %d columns, not a multiple of --block" % (name, ckpt.shapes[name][1]))
+
+    out = bytearray()
+    dense = sparse = 0
+    for name in tensors:
+        rows, cols = ckpt.shapes[name]
+        for layer in range(ckpt.n_layers):
+            weights = array.array("f", ckpt.tensor(name, layer))
+            pruned = prune(weights, rows, cols, args.block, args.sparsity)
+            out += sparse_extension(name, layer, rows, cols, args.block, pruned)
+            dense += rows * cols
+            sparse += len(pruned[2])
+    size = ckpt.write(args.output, bytes(out), tensors if args.drop_dense else ())
+    print("pruned %s: %d of %d weights kept (%.1f%%), %d bytes to %d"
+          % (",".join(tensors), sparse, dense, 100.0 * sparse / max(dense, 1), len(raw), size))
+
+
+if __name__ == "__main__":
+    main()